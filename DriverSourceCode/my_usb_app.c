@@ -12,127 +12,74 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "osrfx2_ioctl.h"
+#include "osrfx2_fleet.h"
 
 #define BUF_LEN 9
 #define SEG_LEN 6
 #define BAR_LEN 6
 #define CHAR_BUF_LEN 32
-#define SLEEP_TIME 200000L
-
-static char *get_switches_state(void) {    
-    const char *attrname = "/sys/class/usb/osrfx2_0/device/switches";   
-    char        attrvalue[BUF_LEN] = {0};
-    int         fd, count;
-
-    fd = open(attrname, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Error opening %s\n", attrname);
-        return NULL;
-    }
-
-    count = read(fd, &attrvalue, sizeof(attrvalue));
-    close(fd);
-    if (count == 8)
-        return strdup(attrvalue);
-
-    return NULL;
-}
-
-static char *get_7segment_state(void) {    
-    const char *attrname = "/sys/class/usb/osrfx2_0/device/7segment";   
-    char        attrvalue[BUF_LEN] = {0};
-    int         fd, count;
-
-    fd = open(attrname, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Error opening %s\n", attrname);
-        return NULL;
-    }
-
-    count = read(fd, &attrvalue, sizeof(attrvalue));
-    close(fd);
-    if (count == 8) {
-        return strdup(attrvalue);
-    }
-
-    return NULL;
+#define MAX_EVENTS 4
+#define DISPLAY_PERIOD_MS 200      /*Display pattern step*/
+#define BULK_PERIOD_TICKS 25       /*Display steps between loopback packets, 5 s*/
+#define READ_TIMEOUT_TICKS 50      /*Display steps to wait for loopback data, 10 s*/
+
+/*epoll user data, which source woke us*/
+enum { SRC_TIMER, SRC_SWITCH, SRC_BULK_IN };
+
+/*Print the switches and the current display state*/
+static void report(int fd, unsigned char switches) {
+    unsigned char seg7_status, bar_status;
+    char str[BUF_LEN];
+
+    fprintf(stdout, "Switch status:    %s\n", osrfx2_bits_to_str(switches, str));
+    if (osrfx2_get_7segment(fd, &seg7_status) == 0)
+        fprintf(stdout, "7 segment status: %s\n", osrfx2_bits_to_str(seg7_status, str));
+    if (osrfx2_get_bargraph(fd, &bar_status) == 0)
+        fprintf(stdout, "Bargraph status:  %s\n", osrfx2_bits_to_str(bar_status, str));
+    fprintf(stdout, "\n");
 }
 
-static char *get_bargraph_state(void) {    
-    const char *attrname = "/sys/class/usb/osrfx2_0/device/bargraph";   
-    char        attrvalue[BUF_LEN] = {0};
-    int         fd, count;
+static int watch(int epfd, int fd, int src) {
+    struct epoll_event ev;
 
-    fd = open(attrname, O_RDONLY);
-    if (fd == -1) {
-        fprintf(stderr, "Error opening %s\n", attrname);
-        return NULL;
-    }
-
-    count = read(fd, &attrvalue, sizeof(attrvalue));
-    close(fd);
-    if (count == 8) {
-        return strdup(attrvalue);
-    }
-
-    return NULL;
-}
-
-static int set_7segment_state(unsigned char value) {
-    const char *attrname = "/sys/class/usb/osrfx2_0/device/7segment";
-    char attrvalue [32];
-    int  fd, count, len;
-    
-    snprintf(attrvalue, sizeof(attrvalue), "%d", value);
-    len = strlen(attrvalue) + 1;
-
-    fd = open( attrname, O_WRONLY );
-    if (fd == -1)
-        return -1;
-
-    count = write( fd, &attrvalue, len );
-    close(fd);
-    if (count != len)
-        return -1;
-
-    return 0;
-}
-
-static int set_bargraph_state(unsigned char value) {
-    const char *attrname = "/sys/class/usb/osrfx2_0/device/bargraph";
-    char attrvalue [32];
-    int  fd, count, len;
-    
-    snprintf(attrvalue, sizeof(attrvalue), "%d", value);
-    len = strlen(attrvalue) + 1;
-
-    fd = open( attrname, O_WRONLY );
-    if (fd == -1)
-        return -1;
-
-    count = write( fd, &attrvalue, len );
-    close(fd);
-    if (count != len)
-        return -1;
-
-    return 0;
+    ev.events   = EPOLLIN;
+    ev.data.u32 = src;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
+/*Sleeps in epoll_wait until the display timer fires, a switch changes or
+  loopback data arrives. Nothing is polled*/
 int main(void) {
     const char *devpath = "/dev/osrfx2_0";
-    char last_sw_status[BUF_LEN] = {0};
-    char this_sw_status[BUF_LEN] = {0};
+    unsigned char switches;
     char buf_w[CHAR_BUF_LEN];
     char buf_r[CHAR_BUF_LEN];
-    unsigned long int dt = 0;
-    int wfd, rfd, wlen, rlen;
+    struct osrfx2_switch_event sw_event;
+    struct epoll_event events[MAX_EVENTS];
+    struct itimerspec period;
+    unsigned long long ticks = 0, expired;
+    unsigned long long sent_tick = 0;
+    int awaiting = 0;
+    int wfd, rfd, efd, tfd, epfd, wlen, rlen, n, i;
     unsigned int packet_num = 0;
     int index = 0;
 
     unsigned char seg7_pattern[] = {0x01, 0x02 | 0x80, 0x04, 0x08 | 0x80, 0x10, 0x20 | 0x80};
     unsigned char bar_pattern [] = {0x01 | 0x80, 0x02 | 0x40, 0x04 | 0x20, 0x08 | 0x10, 0x04 | 0x20, 0x02 | 0x40};
 
+    /*Switch change source. Event mode hands the bulk in pipe back, so
+      open it before the bulk reader*/
+    efd = open(devpath, O_RDONLY | O_NONBLOCK);
+    if (efd == -1 || ioctl(efd, OSRFX2_IOC_EVENT_MODE) < 0) {
+        fprintf(stderr, "open for events: %s failed\n", devpath);
+        return -1;
+    }
+
     wfd = open(devpath, O_WRONLY | O_NONBLOCK);
     if (wfd == -1) {
         fprintf(stderr, "open for write: %s failed\n", devpath);
@@ -145,57 +92,95 @@ int main(void) {
         return -1;
     }
 
-    while(1) {  
-        strcpy(this_sw_status, get_switches_state());
- 
-        /*Report switch changes and current component states*/
-        if(strcmp(last_sw_status, this_sw_status)) {
-            fprintf(stdout, "Switch status:    %s\n", this_sw_status);
-            fprintf(stdout, "7 segment status: %s\n", get_7segment_state());
-            fprintf(stdout, "Bargraph status:  %s\n", get_bargraph_state());
-            fprintf(stdout, "\n");
-            strcpy(last_sw_status, this_sw_status);
-        }
-
-        /*Update 7 segment and bargraph displays*/
-        set_7segment_state(seg7_pattern[index % SEG_LEN]);
-        set_bargraph_state(bar_pattern [index % BAR_LEN]);
-    //set_bargraph_state(0x80);
-        index++;
+    /*Display pattern clock*/
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd == -1) {
+        fprintf(stderr, "timerfd_create failed\n");
+        return -1;
+    }
+    period.it_interval.tv_sec  = DISPLAY_PERIOD_MS / 1000;
+    period.it_interval.tv_nsec = (DISPLAY_PERIOD_MS % 1000) * 1000000L;
+    period.it_value            = period.it_interval;
+    if (timerfd_settime(tfd, 0, &period, NULL) < 0) {
+        fprintf(stderr, "timerfd_settime failed\n");
+        return -1;
+    }
 
-        /*Check if time to read/write to bulk endpoint*/
-        if(dt >= 5000000L) {
-            dt = 0;
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1 || watch(epfd, tfd, SRC_TIMER) < 0 ||
+        watch(epfd, efd, SRC_SWITCH) < 0 || watch(epfd, rfd, SRC_BULK_IN) < 0) {
+        fprintf(stderr, "epoll setup failed\n");
+        return -1;
+    }
 
-            sprintf(buf_w, "Test packet %u", packet_num);
+    /*Initial state, later reports come from switch events*/
+    if (osrfx2_get_switches(rfd, &switches) < 0) {
+        fprintf(stderr, "switch read error\n");
+        return -1;
+    }
+    report(rfd, switches);
 
-            printf("Writing to bulk endpoint: %s\n", buf_w);          
+    while(1) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            fprintf(stderr, "epoll_wait error\n");
+            return -1;
+        }
 
-            /*Write to bulk endpoint*/
-            wlen = write(wfd, buf_w, strlen(buf_w));
-            if (wlen < 0) {
-                fprintf(stderr, "write error\n");
-                return -1;
-            }
- 
-            /*Initialize read buffer*/
-            memset(buf_r, 0, CHAR_BUF_LEN);
-
-            /*Read from bulk endpoint*/
-            rlen = read(rfd, buf_r, strlen(buf_w));
-            if (rlen < 0) {
-                fprintf(stderr, "read error\n", rlen);
-                return -1;
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case SRC_SWITCH:
+                /*Report every queued switch change*/
+                while (read(efd, &sw_event, sizeof(sw_event)) == sizeof(sw_event))
+                    report(rfd, sw_event.switches);
+                break;
+
+            case SRC_BULK_IN:
+                /*Loopback data for the last packet*/
+                memset(buf_r, 0, CHAR_BUF_LEN);
+                rlen = read(rfd, buf_r, CHAR_BUF_LEN - 1);
+                if (rlen < 0) {
+                    fprintf(stderr, "read error\n");
+                    return -1;
+                }
+                printf("Read from bulk endpoint:  %s\n\n", buf_r);
+                awaiting = 0;
+                break;
+
+            case SRC_TIMER:
+                if (read(tfd, &expired, sizeof(expired)) != sizeof(expired))
+                    break;
+                ticks += expired;
+
+                /*Update 7 segment and bargraph displays*/
+                osrfx2_set_display(wfd, seg7_pattern[index % SEG_LEN], bar_pattern [index % BAR_LEN], 0);
+                index++;
+
+                if (awaiting && ticks - sent_tick >= READ_TIMEOUT_TICKS) {
+                    fprintf(stderr, "read timeout\n");
+                    return -1;
+                }
+
+                /*Check if time to write to bulk endpoint, the reply
+                  wakes SRC_BULK_IN*/
+                if (!awaiting && ticks - sent_tick >= BULK_PERIOD_TICKS) {
+                    sprintf(buf_w, "Test packet %u", packet_num);
+
+                    printf("Writing to bulk endpoint: %s\n", buf_w);
+
+                    /*Write to bulk endpoint*/
+                    wlen = write(wfd, buf_w, strlen(buf_w));
+                    if (wlen < 0) {
+                        fprintf(stderr, "write error\n");
+                        return -1;
+                    }
+                    sent_tick = ticks;
+                    awaiting  = 1;
+                    packet_num++;
+                }
+                break;
             }
-
-            printf("Read from bulk endpoint:  %s\n\n", buf_r);
-            packet_num++;
         }
-
-        usleep(SLEEP_TIME);
-
-        /*add elapsed sleep time to dt*/
-        dt += SLEEP_TIME;
     }
 
     return 0;
@@ -15,6 +15,24 @@
 #include <asm/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/scatterlist.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/uio.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pm_runtime.h>
+
+#include "osrfx2_ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "osrfx2_trace.h"
 
 #define VENDOR_ID     0x0547       
 #define PRODUCT_ID    0x1002
@@ -29,23 +47,137 @@
 #define READ_SWITCHES 0xD6
 #define IS_HIGH_SPEED 0xD9
 
+/************************Module parameters***************************/
+#define READ_TIMEOUT  10000        /*Default bulk read timeout and adaptive maximum in ms*/
+#define READ_TIMEOUT_MIN 20        /*Shortest adaptive bulk read timeout in ms*/
+#define READ_BACKOFF_MAX 6         /*Adaptive timeout doublings after consecutive timeouts*/
+#define SG_WRITE_MAX  (4 * 1024 * 1024) /*Largest single scatter-gather write*/
+#define EVENT_FIFO_SIZE 64         /*Switch events queued per event file, power of 2*/
+#define RX_MARKS      64           /*Message ends tracked in rx_ring in message mode, power of 2*/
+#define CTRL_SYNC_TIMEOUT 5000     /*Longest wait for queued register writes in ms*/
+#define RELEASE_TIMEOUT 1000       /*Longest wait in release for bulk writes to drain in ms*/
+#define STAT_LAT_BUCKETS 16        /*log2 microsecond latency buckets, the last is open ended*/
+#define INT_URBS_MAX  8            /*Interrupt in URBs kept in flight at most*/
+#define INT_BACKOFF_MIN 10         /*First interrupt resubmit retry in ms, doubled per failure*/
+#define INT_BACKOFF_MAX 1000       /*Longest interrupt resubmit retry in ms*/
+
+/*Bulk transfer sizing picked from the link speed when left at 0*/
+#define HS_URB_PACKETS 32          /*16 KB per URB at 512 byte packets*/
+#define HS_URBS        8
+#define FS_URB_PACKETS 64          /*4 KB per URB at 64 byte packets*/
+#define FS_URBS        4
+
+static int read_urbs = 0;
+module_param(read_urbs, int, S_IRUGO);
+MODULE_PARM_DESC(read_urbs, "Number of bulk in URBs kept in flight for read-ahead, 0 picks by link speed");
+
+static int read_packets = 0;
+module_param(read_packets, int, S_IRUGO);
+MODULE_PARM_DESC(read_packets, "Size of each read-ahead buffer in max size packets, 0 picks by link speed");
+
+static int write_urbs = 0;
+module_param(write_urbs, int, S_IRUGO);
+MODULE_PARM_DESC(write_urbs, "Number of pooled bulk out URBs, the maximum in flight, 0 picks by link speed");
+
+static int write_packets = 0;
+module_param(write_packets, int, S_IRUGO);
+MODULE_PARM_DESC(write_packets, "Size of each pooled bulk out buffer in max size packets, 0 picks by link speed");
+
+static int int_urbs = 2;
+module_param(int_urbs, int, S_IRUGO);
+MODULE_PARM_DESC(int_urbs, "Number of interrupt in URBs kept in flight so no switch change is missed, 1 to 8");
+
+static int rx_ring_size = 64 * 1024;
+module_param(rx_ring_size, int, S_IRUGO);
+MODULE_PARM_DESC(rx_ring_size, "Bytes of received data buffered per device ahead of read(), rounded up to a power of 2");
+
+static int max_urb_size = 64 * 1024;
+module_param(max_urb_size, int, S_IRUGO);
+MODULE_PARM_DESC(max_urb_size, "Largest read-ahead or pooled bulk out buffer in bytes");
+
+static int sg_write_min = 64 * 1024;
+module_param(sg_write_min, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sg_write_min, "Blocking writes of at least this many bytes go out as one scatter-gather request, 0 disables");
+
+static int mmap_bufs = 16;
+module_param(mmap_bufs, int, S_IRUGO);
+MODULE_PARM_DESC(mmap_bufs, "Number of mmap ring buffers in each direction");
+
+static int mmap_buf_size = 64 * 1024;
+module_param(mmap_buf_size, int, S_IRUGO);
+MODULE_PARM_DESC(mmap_buf_size, "Size of each mmap ring buffer, rounded up to a page");
+
+static int autosuspend_ms = 2000;
+module_param(autosuspend_ms, int, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_ms, "Idle time before a board is runtime suspended in ms, negative leaves autosuspend off");
+
+static int read_timeout_ms = READ_TIMEOUT;
+module_param(read_timeout_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_timeout_ms, "Default bulk read timeout in ms for files that set none, -1 adapts it to measured latency");
+
+static int readback_ms = 0;
+module_param(readback_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(readback_ms, "Re-read cached bargraph and 7 segment values from the device after this many ms, 0 never");
+
 /**********************Function prototypes***************************/
 static int osrfx2_open(struct inode * inode, struct file * file);
 static int osrfx2_release(struct inode * inode, struct file * file);
-static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos);
-static ssize_t osrfx2_write(struct file * file, const char * user_buffer, size_t count, loff_t * ppos);
+static int osrfx2_flush(struct file * file, fl_owner_t id);
+static int osrfx2_fsync(struct file * file, loff_t start, loff_t end, int datasync);
+static ssize_t osrfx2_read_iter(struct kiocb * iocb, struct iov_iter * to);
+static ssize_t osrfx2_write_iter(struct kiocb * iocb, struct iov_iter * from);
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg);
+static int osrfx2_mmap(struct file * file, struct vm_area_struct * vma);
+static unsigned int osrfx2_poll(struct file * file, poll_table * wait);
 static int osrfx2_probe(struct usb_interface * interface, const struct usb_device_id * id);
 static void osrfx2_disconnect(struct usb_interface * interface);
 static int osrfx2_suspend(struct usb_interface * intf, pm_message_t message);
 static int osrfx2_resume(struct usb_interface * intf);
 static void osrfx2_delete(struct kref * kref);
+static void osrfx2_kill_all(struct osrfx2 * fx2dev);
 static void write_bulk_callback(struct urb *urb);
+static void read_bulk_callback(struct urb *urb);
+static void osrfx2_pick_sizes(struct osrfx2 * fx2dev);
+static int osrfx2_rx_alloc(struct osrfx2 * fx2dev);
+static void osrfx2_rx_free(struct osrfx2 * fx2dev);
+static void osrfx2_rx_start(struct osrfx2 * fx2dev);
+static void osrfx2_rx_stop(struct osrfx2 * fx2dev);
+static int osrfx2_tx_alloc(struct osrfx2 * fx2dev);
+static void osrfx2_tx_free(struct osrfx2 * fx2dev);
+static void mmap_bulk_callback(struct urb *urb);
+static void osrfx2_mmap_free(struct osrfx2 * fx2dev);
+static void osrfx2_mmap_reset(struct osrfx2 * fx2dev, int is_out);
+static int osrfx2_mmap_in_busy(struct osrfx2 * fx2dev);
+static int osrfx2_int_alloc(struct osrfx2 * fx2dev);
+static void osrfx2_int_free(struct osrfx2 * fx2dev);
+static int osrfx2_int_start(struct osrfx2 * fx2dev);
+static void osrfx2_int_stop(struct osrfx2 * fx2dev);
+static void osrfx2_int_retry(struct work_struct * work);
 static void interrupt_handler(struct urb * urb);
+static unsigned char osrfx2_switches(struct osrfx2 * fx2dev, unsigned int * seq);
+static void osrfx2_notify_work(struct work_struct * work);
 static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr, const char *buf,size_t count);
 static ssize_t get_7segment(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t set_refresh(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t set_sync(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t get_link_speed(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_read_urbs(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_read_urb_size(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_write_urbs(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t get_write_urb_size(struct device *dev, struct device_attribute *attr, char *buf);
+static void ctrl_callback(struct urb *urb);
+static void ctrl_in_callback(struct urb *urb);
+static int osrfx2_ctrl_alloc(struct osrfx2 * fx2dev, struct osrfx2_reg * reg);
+static void osrfx2_ctrl_free(struct osrfx2 * fx2dev, struct osrfx2_reg * reg);
+static void osrfx2_ctrl_stop(struct osrfx2 * fx2dev);
+static void osrfx2_ctrl_start(struct osrfx2 * fx2dev);
+static int osrfx2_ctrl_sync(struct osrfx2 * fx2dev);
+static int osrfx2_ctrl_in(struct osrfx2 * fx2dev, __u8 request, unsigned char * value);
+static int osrfx2_reg_write(struct osrfx2 * fx2dev, struct osrfx2_reg * reg, unsigned char value);
+static int osrfx2_reg_read(struct osrfx2 * fx2dev, struct osrfx2_reg * reg, int force, unsigned char * value);
 
 /***********************Module structures****************************/
 /*Table of devices that work with this driver*/
@@ -56,6 +188,171 @@ static const struct usb_device_id osrfx2_id_table [] = {
 
 MODULE_DEVICE_TABLE(usb, osrfx2_id_table);
 
+/*Bit order lookup tables, built at compile time. The intuitive bit order
+  used by sysfs and ioctl has bargraph bit 0 = bottom, bit 7 = top and
+  7 segment bit 0 = seg a, bit 7 = decimal*/
+#define TBL4(f, n)   f(n), f((n) + 1), f((n) + 2), f((n) + 3)
+#define TBL16(f, n)  TBL4(f, n), TBL4(f, (n) + 4), TBL4(f, (n) + 8), TBL4(f, (n) + 12)
+#define TBL64(f, n)  TBL16(f, n), TBL16(f, (n) + 16), TBL16(f, (n) + 32), TBL16(f, (n) + 48)
+#define TBL256(f)    TBL64(f, 0), TBL64(f, 64), TBL64(f, 128), TBL64(f, 192)
+
+#define LEDS_ENC(v)  ((((v) >> 3) & 0x1F) | (((v) << 5) & 0xE0))
+#define LEDS_DEC(v)  ((((v) << 3) & 0xF8) | (((v) >> 5) & 0x07))
+#define SEG_ENC(v)   (((v) & 0x17) | (((v) >> 4) & 0x08) | (((v) >> 1) & 0x20) | \
+                      (((v) << 1) & 0x40) | (((v) << 4) & 0x80))
+#define SEG_DEC(v)   (((v) & 0x17) | (((v) << 4) & 0x80) | (((v) << 1) & 0x40) | \
+                      (((v) >> 1) & 0x20) | (((v) >> 4) & 0x08))
+#define BIT_CHR(v, b) ((((v) >> (b)) & 1) ? '1' : '0')
+#define BITS_STR(v)  { BIT_CHR(v, 7), BIT_CHR(v, 6), BIT_CHR(v, 5), BIT_CHR(v, 4), \
+                       BIT_CHR(v, 3), BIT_CHR(v, 2), BIT_CHR(v, 1), BIT_CHR(v, 0), '\0' }
+
+static const unsigned char leds_enc[256] = { TBL256(LEDS_ENC) };  /*Intuitive to hardware*/
+static const unsigned char leds_dec[256] = { TBL256(LEDS_DEC) };  /*Hardware to intuitive*/
+static const unsigned char seg_enc[256]  = { TBL256(SEG_ENC) };
+static const unsigned char seg_dec[256]  = { TBL256(SEG_DEC) };
+
+/*Attribute text of each byte value, bit 7 first*/
+#define BITS_STR_LEN 8
+static const char bits_str[256][BITS_STR_LEN + 1] = { TBL256(BITS_STR) };
+
+/*Bulk in read-ahead buffer. Each one is either in flight on rx_anchor,
+  parked with received data on rx_done while rx_ring is too full to take
+  it, or waiting for resubmission on rx_idle*/
+struct osrfx2_rx {
+    struct list_head list;
+    struct osrfx2  * fx2dev;
+    struct urb     * urb;
+    unsigned char  * buffer;
+    size_t           length;        /*Bytes received*/
+    size_t           offset;        /*Bytes already copied to userspace*/
+    int              end;           /*Short transfer, ends a message in message mode*/
+};
+
+/*Interrupt in URB. Either in flight on int_anchor or marked in int_idle*/
+struct osrfx2_int {
+    struct osrfx2  * fx2dev;
+    struct urb     * urb;
+    unsigned char  * buffer;
+    int              index;         /*Bit in int_idle*/
+};
+
+/*Async write in flight, completed when its last pool entry completes*/
+struct osrfx2_aio {
+    struct kiocb * iocb;
+    atomic_t       pending;         /*Pool entries in flight, plus one while submitting*/
+    atomic_long_t  bytes;           /*Bytes sent so far*/
+    int            status;          /*First error seen*/
+};
+
+/*Pooled bulk out buffer. Lives on tx_free while not in flight*/
+struct osrfx2_tx {
+    struct list_head list;
+    struct osrfx2  * fx2dev;
+    struct urb     * urb;
+    unsigned char  * buffer;
+    struct osrfx2_aio * aio;        /*Async write this entry belongs to, if any*/
+    u64              submit_ns;     /*ktime_get_ns() at submission*/
+};
+
+/*mmap ring buffer states*/
+#define MBUF_IDLE     0            /*Owned by user space*/
+#define MBUF_QUEUED   1            /*Submitted to the device*/
+#define MBUF_DONE     2            /*Completed, waiting to be reaped*/
+
+/*mmap ring buffer. Lives on mmap_in_done or mmap_out_done once completed*/
+struct osrfx2_mbuf {
+    struct list_head list;
+    struct osrfx2  * fx2dev;
+    struct urb     * urb;
+    unsigned char  * buffer;
+    __u32            index;         /*Index within its direction*/
+    int              is_out;
+    int              state;
+};
+
+/*Cached bargraph or 7 segment register. The last value written through
+  sysfs is authoritative, the device is only read when the cache is cold,
+  stale or a refresh is forced. Writes go out asynchronously on one
+  control URB per register. Writes made while it is in flight are merged
+  so only the latest value is sent next*/
+struct osrfx2_reg {
+    struct osrfx2          * fx2dev;
+    __u8                     read_cmd;  /*READ_LEDS or READ_7SEG*/
+    __u8                     set_cmd;   /*SET_LEDS or SET_7SEG*/
+    unsigned char            value;     /*Hardware bit order*/
+    int                      valid;     /*value matches the device, or will once sent*/
+    unsigned long            stamp;     /*jiffies when value was last synced*/
+
+    struct urb             * urb;       /*Async SET request*/
+    struct usb_ctrlrequest * setup;
+    unsigned char          * buffer;    /*Value carried by urb*/
+    int                      dirty;     /*value still has to be sent*/
+    int                      busy;      /*urb is in flight*/
+    unsigned int             seq;       /*Bumped by every write*/
+    unsigned int             sent_seq;  /*seq of the value in flight*/
+    unsigned int             done_seq;  /*seq of the last value the device took*/
+    int                      error;     /*First failure since the last barrier*/
+    u64                      submit_ns; /*ktime_get_ns() at submission*/
+};
+
+/*Endpoints counted in struct osrfx2_stats*/
+enum {
+    STAT_EP_BULK_IN,
+    STAT_EP_BULK_OUT,
+    STAT_EP_INT_IN,
+    STAT_EP_CTRL,
+    STAT_EP_COUNT
+};
+
+/*URB status codes counted separately, anything else counts as other*/
+static const int stat_err_codes[] = {
+    -ENOENT, -ECONNRESET, -ESHUTDOWN, -ENODEV, -EPIPE, -EPROTO,
+    -EILSEQ, -ETIME, -ETIMEDOUT, -EOVERFLOW, -EREMOTEIO,
+};
+#define STAT_ERRS ARRAY_SIZE(stat_err_codes)
+
+/*Transfer counters of one endpoint*/
+struct osrfx2_ep_stats {
+    atomic64_t submitted;           /*Requests accepted by usb core*/
+    atomic64_t submit_bytes;
+    atomic64_t completed;           /*Requests given back, with or without error*/
+    atomic64_t complete_bytes;      /*actual_length of the completed requests*/
+    atomic64_t errors[STAT_ERRS + 1]; /*By stat_err_codes, then other*/
+    atomic_t   in_flight;           /*Not cleared with the counters*/
+};
+
+/*Data path statistics, shown in debugfs. Counters are atomic so the
+  completion handlers can update them without a lock*/
+struct osrfx2_stats {
+    struct osrfx2_ep_stats ep[STAT_EP_COUNT];
+    atomic64_t ctrl_lat[STAT_LAT_BUCKETS]; /*Control request round trip*/
+    atomic64_t out_lat[STAT_LAT_BUCKETS];  /*Pooled bulk out URB round trip*/
+    atomic_t   tx_peak;             /*Highest tx_in_flight seen*/
+    atomic64_t int_events;          /*Switch changes reported*/
+    atomic64_t events_dropped;      /*Changes lost to a full event file fifo*/
+    unsigned long int_window;       /*jiffies the current one second window began*/
+    unsigned int  int_window_events;
+    unsigned int  int_rate;         /*Switch changes in the last full second*/
+    atomic64_t pm_suspends;         /*Runtime suspends*/
+    atomic64_t pm_resumes;          /*Resumes, runtime and system*/
+    atomic64_t wake_lat[STAT_LAT_BUCKETS]; /*Resume time seen by the I/O that woke the device*/
+};
+
+/*Per open file state, kept in file->private_data*/
+struct osrfx2_file {
+    struct osrfx2 * fx2dev;
+    unsigned int    switch_seq;     /*Last switch change reported by poll*/
+    int             claimed_in;     /*Holds bulk_read_available*/
+    int             claimed_out;    /*Holds bulk_write_available*/
+    int             event_mode;     /*read() returns switch events*/
+    int             read_timeout;   /*ms, 0 = read_timeout_ms, OSRFX2_READ_TIMEOUT_ADAPTIVE*/
+    int             msg_mode;       /*Each write() ends with a short packet or ZLP*/
+
+    struct list_head event_node;    /*On fx2dev->event_files while in event mode*/
+    DECLARE_KFIFO(events, struct osrfx2_switch_event, EVENT_FIFO_SIZE); /*Filled by interrupt_handler*/
+    struct mutex     event_mutex;   /*Serializes readers of this file, the only kfifo consumers*/
+};
+
 /*OSR FX2 private device context structure*/
 struct osrfx2 {    
     struct usb_device    * udev;        /* the usb device for this device */
@@ -63,10 +360,6 @@ struct osrfx2 {
     
     wait_queue_head_t FieldEventQueue;      /*Queue for poll and irq methods*/    
    
-    unsigned char * int_in_buffer;      
-    unsigned char * bulk_in_buffer;     /*Transfer Buffers*/
-    unsigned char * bulk_out_buffer;        
-    
     size_t int_in_size;
     size_t bulk_in_size;            /*Buffer sizes*/
     size_t bulk_out_size;
@@ -79,33 +372,120 @@ struct osrfx2 {
     __u8  bulk_in_endpointInterval;     /*Endpoint intervals*/
     __u8  bulk_out_endpointInterval;
     
-    struct urb * bulk_in_urb;
-    struct urb * int_in_urb;            /*URBs*/
+    struct urb * bulk_in_urb;           /*URBs*/
     struct urb * bulk_out_urb;
+
+    struct osrfx2_int int_in[INT_URBS_MAX]; /*Interrupt in URBs queued back to back*/
+    int               int_count;
+    struct usb_anchor int_anchor;   /*Interrupt URBs in flight*/
+    spinlock_t        int_lock;     /*Protects int_idle, int_running, int_backoff, int_halted*/
+    unsigned long     int_idle;     /*Interrupt URBs not in flight, one bit each*/
+    int               int_running;  /*Interrupt URBs should be in flight*/
+    unsigned int      int_backoff;  /*Current retry delay in ms, 0 while healthy*/
+    int               int_halted;   /*Endpoint stalled, clear it before retrying*/
+    struct delayed_work int_retry;  /*Resubmits idle interrupt URBs after a failure*/
     
+    struct osrfx2_rx * rx;          /*Bulk in read-ahead ring*/
+    int               rx_count;
+    size_t            rx_size;      /*Bytes per read-ahead buffer*/
+    struct usb_anchor rx_anchor;    /*Read-ahead URBs in flight*/
+    struct list_head  rx_done;      /*Completed buffers parked, oldest first*/
+    struct list_head  rx_idle;      /*Buffers waiting to be submitted*/
+    spinlock_t        rx_lock;      /*Protects the rx lists and rx_error*/
+    wait_queue_head_t rx_wait;      /*Readers waiting for read-ahead data*/
+    int               rx_running;   /*Read-ahead started by a reader*/
+    int               rx_error;     /*Last bulk in error not yet reported*/
+    unsigned char   * rx_ring;      /*Received data not yet read, filled by read_bulk_callback*/
+    size_t            rx_ring_size; /*Power of 2, at least rx_size*/
+    size_t            rx_head;      /*Free running, advanced by read_bulk_callback*/
+    size_t            rx_tail;      /*Free running, advanced by the reader*/
+    size_t            rx_lowat;     /*Bytes buffered before readers and pollers wake*/
+    size_t            rx_want;      /*Wake threshold of a waiting reader, at most rx_lowat*/
+    long              rx_srtt_us;   /*Smoothed wait for data of reads that got it, 0 = none yet*/
+    long              rx_rttvar_us; /*Mean deviation of those waits*/
+    unsigned int      rx_backoff;   /*Adaptive timeouts in a row, each doubles the next*/
+    int               rx_msg;       /*Message mode, reads stop at message ends*/
+    size_t            rx_marks[RX_MARKS]; /*rx_head at each message end not yet read*/
+    unsigned int      rx_mark_head; /*Free running indexes into rx_marks*/
+    unsigned int      rx_mark_tail;
+    size_t            rx_msg_end;   /*Last message end, a ZLP right after it starts no new one*/
+    int               rx_prefetch;  /*Keep URBs in flight with nobody reading*/
+    int               rx_pull;      /*A reader or poller is waiting for data*/
+
     struct kref kref;               /*Reference counter*/
 
+    seqlock_t     switch_lock;      /*Written by interrupt_handler, readers retry*/
     unsigned char switches;         /*Switch status*/
-    unsigned char segments;         /*7 segment status*/
-    unsigned char leds;             /*LEDs status*/
+    unsigned int  switch_seq;       /*Bumped on every switch change*/
+
+    struct list_head event_files;   /*Files in event mode, each gets every switch change*/
+    spinlock_t    event_lock;       /*Protects event_files, held by the kfifo producer*/
+    struct work_struct notify_work; /*Runs sysfs_notify outside interrupt context*/
+    struct osrfx2_reg segments;     /*7 segment status*/
+    struct osrfx2_reg leds;         /*LEDs status*/
+    unsigned char   * ctrl_buf;     /*DMA-able byte for register reads*/
+    struct urb      * ctrl_in_urb;  /*Register read, anchored on ctrl_anchor while in flight*/
+    struct usb_ctrlrequest * ctrl_in_setup;
+    struct completion ctrl_in_done;
+    struct mutex      ctrl_mutex;   /*Serializes register reads*/
+    spinlock_t        ctrl_lock;    /*Protects the register cache and async state*/
+    wait_queue_head_t ctrl_wait;    /*Barrier waiters*/
+    struct usb_anchor ctrl_anchor;  /*Register reads and writes in flight*/
+    int               ctrl_stopped; /*No register writes go out while set*/
 
     atomic_t bulk_write_available;      /*Track usage of the bulk pipes*/
     atomic_t bulk_read_available;
 
-    size_t pending_data;            /*Data tracking for read write*/
-
-    int suspended;                  /*boolean*/
-
-    struct semaphore sem;           /*used during suspending and resuming device*/
-    struct mutex io_mutex;          /*used during cleanup after disconnect*/
+    atomic_t pending_data;          /*Data tracking for read write*/
+
+    struct osrfx2_tx * tx;          /*Bulk out URB and buffer pool*/
+    int               tx_count;
+    size_t            tx_size;      /*Bytes per pooled buffer*/
+    struct list_head  tx_free;      /*Pool entries ready for a write*/
+    struct usb_anchor tx_anchor;    /*Pool URBs in flight, poisoned by disconnect*/
+    spinlock_t        tx_lock;      /*Protects tx_free and tx_sg*/
+    struct usb_sg_request * tx_sg;  /*Scatter-gather write in flight, cancelled by disconnect*/
+    wait_queue_head_t tx_wait;      /*Pollers waiting for a free entry, flush and fsync*/
+
+    struct semaphore limit_sem;     /*Counts the entries on tx_free*/
+
+    struct osrfx2_stats stats;      /*Data path statistics*/
+    struct dentry   * debugfs_dir;  /*debugfs osrfx2/osrfx2_N*/
+
+    struct osrfx2_mbuf * mbuf;      /*mmap ring, in buffers then out buffers*/
+    int               mbuf_count;   /*Buffers per direction*/
+    size_t            mbuf_size;
+    struct mutex      mmap_mutex;   /*Serializes allocating the mmap ring*/
+    struct usb_anchor mmap_anchor;  /*mmap URBs in flight*/
+    struct list_head  mmap_in_done; /*Completed buffers, oldest first*/
+    struct list_head  mmap_out_done;
+    int               mmap_queued[2]; /*Buffers in flight, indexed by is_out*/
+    spinlock_t        mmap_lock;    /*Protects buffer states, lists and counts*/
+    wait_queue_head_t mmap_wait;    /*Reapers waiting for a completion*/
+    atomic_t tx_in_flight;          /*Bulk out URBs submitted, not completed*/
+    int      tx_error;              /*First pool or mmap write failure since the last flush or fsync*/
+
+    int suspended;                  /*boolean, READ_ONCE outside suspend and resume*/
+    struct usb_interface * pm_intf; /*interface for runtime PM calls, pinned until osrfx2_delete*/
+    spinlock_t pm_lock;             /*Orders PM reference changes against disconnect*/
+    int        pm_gone;             /*Disconnect ran, usb core owns the references now*/
+    int high_speed;                 /*Link runs at high speed, from IS_HIGH_SPEED*/
+
+    struct mutex rx_mutex;          /*Serializes bulk in users, and them against disconnect*/
+    struct mutex tx_mutex;          /*Serializes scatter-gather and mmap bulk out against disconnect*/
 };
 
 static const struct file_operations osrfx2_fops = {
     .owner   = THIS_MODULE,
     .open    = osrfx2_open,
     .release = osrfx2_release,
-    .read    = osrfx2_read,
-    .write   = osrfx2_write,
+    .flush   = osrfx2_flush,
+    .fsync   = osrfx2_fsync,
+    .read_iter  = osrfx2_read_iter,
+    .write_iter = osrfx2_write_iter,
+    .unlocked_ioctl = osrfx2_ioctl,
+    .mmap    = osrfx2_mmap,
+    .poll    = osrfx2_poll,
 };
 
 static struct usb_driver osrfx2_driver = {
@@ -115,6 +495,7 @@ static struct usb_driver osrfx2_driver = {
     .suspend     = osrfx2_suspend,
     .resume      = osrfx2_resume,
     .id_table    = osrfx2_id_table,
+    .supports_autosuspend = 1,
 };
 
 /*Used to get a minor number from the usb core
@@ -132,15 +513,46 @@ static DEVICE_ATTR(switches, S_IRUGO, get_switches, NULL);
 static DEVICE_ATTR(bargraph, S_IRUGO | S_IWUGO, get_bargraph, set_bargraph);
 /*Create device attribute 7segment*/
 static DEVICE_ATTR(7segment, S_IRUGO | S_IWUGO, get_7segment, set_7segment);
+/*Create device attribute refresh*/
+static DEVICE_ATTR(refresh, S_IWUSR, NULL, set_refresh);
+/*Create device attribute sync*/
+static DEVICE_ATTR(sync, S_IWUSR, NULL, set_sync);
+
+/*Create the transfer group, the bulk sizes picked at probe*/
+static DEVICE_ATTR(link_speed, S_IRUGO, get_link_speed, NULL);
+static DEVICE_ATTR(read_urbs, S_IRUGO, get_read_urbs, NULL);
+static DEVICE_ATTR(read_urb_size, S_IRUGO, get_read_urb_size, NULL);
+static DEVICE_ATTR(write_urbs, S_IRUGO, get_write_urbs, NULL);
+static DEVICE_ATTR(write_urb_size, S_IRUGO, get_write_urb_size, NULL);
+
+static struct attribute *osrfx2_transfer_attrs[] = {
+    &dev_attr_link_speed.attr,
+    &dev_attr_read_urbs.attr,
+    &dev_attr_read_urb_size.attr,
+    &dev_attr_write_urbs.attr,
+    &dev_attr_write_urb_size.attr,
+    NULL,
+};
+
+static const struct attribute_group osrfx2_transfer_group = {
+    .name  = "transfer",
+    .attrs = osrfx2_transfer_attrs,
+};
+
+static struct dentry *osrfx2_debugfs_root; /*debugfs osrfx2, one directory per device*/
 
 /*insmod*/
 int init_module(void) {
     int retval;
 
+    osrfx2_debugfs_root = debugfs_create_dir("osrfx2", NULL);
+
     retval = usb_register(&osrfx2_driver);
 
-    if(retval)
+    if(retval) {
         err("usb_register failed. Error number %d", retval);
+        debugfs_remove_recursive(osrfx2_debugfs_root);
+    }
 
     return retval;
 }
@@ -148,13 +560,168 @@ int init_module(void) {
 /*rmmod*/
 void cleanup_module(void) {
     usb_deregister(&osrfx2_driver);
+    debugfs_remove_recursive(osrfx2_debugfs_root);
+}
+
+/***************************Statistics*******************************/
+/*Count a request accepted by usb_submit_urb*/
+static void osrfx2_stat_submit(struct osrfx2 * fx2dev, int ep, size_t bytes) {
+    struct osrfx2_ep_stats *es = &fx2dev->stats.ep[ep];
+
+    atomic64_inc(&es->submitted);
+    atomic64_add(bytes, &es->submit_bytes);
+    atomic_inc(&es->in_flight);
+}
+
+/*Count a request given back by usb core*/
+static void osrfx2_stat_complete(struct osrfx2 * fx2dev, int ep, int status, size_t bytes) {
+    struct osrfx2_ep_stats *es = &fx2dev->stats.ep[ep];
+    int i;
+
+    atomic64_inc(&es->completed);
+    atomic64_add(bytes, &es->complete_bytes);
+    atomic_dec(&es->in_flight);
+
+    if (!status)
+        return;
+    for (i = 0; i < STAT_ERRS; i++)
+        if (stat_err_codes[i] == status)
+            break;
+    atomic64_inc(&es->errors[i]);
+}
+
+/*Add the time since start_ns to a latency histogram*/
+static void osrfx2_stat_latency(atomic64_t * hist, u64 start_ns) {
+    u64 us = div_u64(ktime_get_ns() - start_ns, NSEC_PER_USEC);
+
+    atomic64_inc(&hist[min_t(int, fls64(us), STAT_LAT_BUCKETS - 1)]);
+}
+
+/*Track the deepest bulk out queue seen*/
+static void osrfx2_stat_depth(struct osrfx2 * fx2dev, int depth) {
+    int peak = atomic_read(&fx2dev->stats.tx_peak);
+
+    while (depth > peak) {
+        int old = atomic_cmpxchg(&fx2dev->stats.tx_peak, peak, depth);
+        if (old == peak)
+            break;
+        peak = old;
+    }
+}
+
+/*Count a switch change and roll the one second rate window.
+  Only called from interrupt_handler*/
+static void osrfx2_stat_int_event(struct osrfx2 * fx2dev) {
+    struct osrfx2_stats *st = &fx2dev->stats;
+
+    atomic64_inc(&st->int_events);
+
+    if (time_after_eq(jiffies, st->int_window + HZ)) {
+        /*A window with no events at all means the rate dropped to zero*/
+        st->int_rate = time_after_eq(jiffies, st->int_window + 2 * HZ) ? 0 : st->int_window_events;
+        st->int_window = jiffies;
+        st->int_window_events = 0;
+    }
+    st->int_window_events++;
+}
+
+static void osrfx2_stat_show_hist(struct seq_file * m, const char * name, atomic64_t * hist) {
+    int i;
+
+    seq_printf(m, "%s_us:", name);
+    for (i = 0; i < STAT_LAT_BUCKETS - 1; i++)
+        seq_printf(m, " <%lu:%lld", 1UL << i, (long long)atomic64_read(&hist[i]));
+    seq_printf(m, " >=%lu:%lld\n", 1UL << i, (long long)atomic64_read(&hist[i]));
+}
+
+static int osrfx2_stats_show(struct seq_file * m, void * v) {
+    static const char * const ep_names[STAT_EP_COUNT] = { "bulk_in", "bulk_out", "int_in", "ctrl" };
+    struct osrfx2 *fx2dev = m->private;
+    struct osrfx2_stats *st = &fx2dev->stats;
+    struct osrfx2_ep_stats *es;
+    int ep, i;
+
+    for (ep = 0; ep < STAT_EP_COUNT; ep++) {
+        es = &st->ep[ep];
+
+        seq_printf(m, "%s: submitted %lld (%lld bytes) completed %lld (%lld bytes) in_flight %d\n",
+                   ep_names[ep],
+                   (long long)atomic64_read(&es->submitted), (long long)atomic64_read(&es->submit_bytes),
+                   (long long)atomic64_read(&es->completed), (long long)atomic64_read(&es->complete_bytes),
+                   atomic_read(&es->in_flight));
+
+        seq_printf(m, "%s_errors:", ep_names[ep]);
+        for (i = 0; i < STAT_ERRS; i++)
+            seq_printf(m, " %d:%lld", stat_err_codes[i], (long long)atomic64_read(&es->errors[i]));
+        seq_printf(m, " other:%lld\n", (long long)atomic64_read(&es->errors[i]));
+    }
+
+    seq_printf(m, "tx_in_flight: %d peak %d of %d\n", atomic_read(&fx2dev->tx_in_flight),
+               atomic_read(&st->tx_peak), fx2dev->tx_count);
+    seq_printf(m, "pending_data: %d\n", atomic_read(&fx2dev->pending_data));
+    seq_printf(m, "read_wait: srtt %ld us rttvar %ld us backoff %u\n", READ_ONCE(fx2dev->rx_srtt_us),
+               READ_ONCE(fx2dev->rx_rttvar_us), READ_ONCE(fx2dev->rx_backoff));
+    seq_printf(m, "int_events: %lld rate %u/s\n", (long long)atomic64_read(&st->int_events),
+               time_after_eq(jiffies, st->int_window + 2 * HZ) ? 0 : st->int_rate);
+    seq_printf(m, "events_dropped: %lld\n", (long long)atomic64_read(&st->events_dropped));
+    osrfx2_stat_show_hist(m, "ctrl_latency", st->ctrl_lat);
+    osrfx2_stat_show_hist(m, "bulk_out_latency", st->out_lat);
+    seq_printf(m, "runtime_pm: suspends %lld resumes %lld%s\n",
+               (long long)atomic64_read(&st->pm_suspends), (long long)atomic64_read(&st->pm_resumes),
+               READ_ONCE(fx2dev->suspended) ? " (suspended)" : "");
+    osrfx2_stat_show_hist(m, "wakeup_latency", st->wake_lat);
+
+    return 0;
 }
 
+static int osrfx2_stats_open(struct inode * inode, struct file * file) {
+    return single_open(file, osrfx2_stats_show, inode->i_private);
+}
+
+/*Any write clears the counters*/
+static ssize_t osrfx2_stats_write(struct file * file, const char __user * buf, size_t count, loff_t * ppos) {
+    struct osrfx2 *fx2dev = ((struct seq_file *)file->private_data)->private;
+    struct osrfx2_stats *st = &fx2dev->stats;
+    struct osrfx2_ep_stats *es;
+    int ep, i;
+
+    for (ep = 0; ep < STAT_EP_COUNT; ep++) {
+        es = &st->ep[ep];
+        atomic64_set(&es->submitted, 0);
+        atomic64_set(&es->submit_bytes, 0);
+        atomic64_set(&es->completed, 0);
+        atomic64_set(&es->complete_bytes, 0);
+        for (i = 0; i <= STAT_ERRS; i++)
+            atomic64_set(&es->errors[i], 0);
+    }
+    for (i = 0; i < STAT_LAT_BUCKETS; i++) {
+        atomic64_set(&st->ctrl_lat[i], 0);
+        atomic64_set(&st->out_lat[i], 0);
+        atomic64_set(&st->wake_lat[i], 0);
+    }
+    atomic64_set(&st->pm_suspends, 0);
+    atomic64_set(&st->pm_resumes, 0);
+    atomic_set(&st->tx_peak, atomic_read(&fx2dev->tx_in_flight));
+    atomic64_set(&st->int_events, 0);
+    atomic64_set(&st->events_dropped, 0);
+
+    return count;
+}
+
+static const struct file_operations osrfx2_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = osrfx2_stats_open,
+    .read    = seq_read,
+    .write   = osrfx2_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id * id) {
     struct usb_device *udev = interface_to_usbdev(intf);
     struct osrfx2 *fx2dev = NULL;
     struct usb_endpoint_descriptor *endpoint;
-    int retval, i, pipe;
+    int retval, i;
 
     /*Create and initialize context struct*/
     fx2dev = kmalloc(sizeof(struct osrfx2), GFP_KERNEL);
@@ -170,11 +737,44 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
 
     /*Set initial fx2dev struct members*/
     kref_init( &fx2dev->kref );
-    mutex_init(&fx2dev->io_mutex);
-    sema_init(&fx2dev->sem, 1);
+    mutex_init(&fx2dev->rx_mutex);
+    mutex_init(&fx2dev->tx_mutex);
+    INIT_LIST_HEAD(&fx2dev->tx_free);
+    init_usb_anchor(&fx2dev->tx_anchor);
+    spin_lock_init(&fx2dev->tx_lock);
+    spin_lock_init(&fx2dev->pm_lock);
+    init_waitqueue_head(&fx2dev->tx_wait);
+    mutex_init(&fx2dev->mmap_mutex);
+    init_usb_anchor(&fx2dev->mmap_anchor);
+    INIT_LIST_HEAD(&fx2dev->mmap_in_done);
+    INIT_LIST_HEAD(&fx2dev->mmap_out_done);
+    spin_lock_init(&fx2dev->mmap_lock);
+    init_waitqueue_head(&fx2dev->mmap_wait);
     init_waitqueue_head(&fx2dev->FieldEventQueue);
+    INIT_LIST_HEAD(&fx2dev->event_files);
+    spin_lock_init(&fx2dev->event_lock);
+    INIT_WORK(&fx2dev->notify_work, osrfx2_notify_work);
+    seqlock_init(&fx2dev->switch_lock);
+    init_usb_anchor(&fx2dev->int_anchor);
+    spin_lock_init(&fx2dev->int_lock);
+    INIT_DELAYED_WORK(&fx2dev->int_retry, osrfx2_int_retry);
+    mutex_init(&fx2dev->ctrl_mutex);
+    spin_lock_init(&fx2dev->ctrl_lock);
+    init_waitqueue_head(&fx2dev->ctrl_wait);
+    init_usb_anchor(&fx2dev->ctrl_anchor);
+    init_completion(&fx2dev->ctrl_in_done);
+    fx2dev->leds.read_cmd     = READ_LEDS;
+    fx2dev->leds.set_cmd      = SET_LEDS;
+    fx2dev->segments.read_cmd = READ_7SEG;
+    fx2dev->segments.set_cmd  = SET_7SEG;
+    init_waitqueue_head(&fx2dev->rx_wait);
+    init_usb_anchor(&fx2dev->rx_anchor);
+    INIT_LIST_HEAD(&fx2dev->rx_done);
+    INIT_LIST_HEAD(&fx2dev->rx_idle);
+    spin_lock_init(&fx2dev->rx_lock);
     fx2dev->udev = usb_get_dev(udev);
     fx2dev->interface = intf;
+    fx2dev->pm_intf   = usb_get_intf(intf);
     fx2dev->bulk_write_available = (atomic_t) ATOMIC_INIT(1);
     fx2dev->bulk_read_available  = (atomic_t) ATOMIC_INIT(1);
     usb_set_intfdata(intf, fx2dev);
@@ -198,6 +798,39 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
         return retval;
     }
+    retval = device_create_file(&intf->dev, &dev_attr_refresh);
+    if (retval != 0) {
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
+    retval = device_create_file(&intf->dev, &dev_attr_sync);
+    if (retval != 0) {
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
+
+    /*Create register read urb and transfer buffer*/
+    fx2dev->ctrl_buf      = kmalloc(sizeof(*fx2dev->ctrl_buf), GFP_KERNEL);
+    fx2dev->ctrl_in_setup = kmalloc(sizeof(*fx2dev->ctrl_in_setup), GFP_KERNEL);
+    fx2dev->ctrl_in_urb   = usb_alloc_urb(0, GFP_KERNEL);
+    if (!fx2dev->ctrl_buf || !fx2dev->ctrl_in_setup || !fx2dev->ctrl_in_urb) {
+        retval = -ENOMEM;
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
+
+    /*Create async register write urbs*/
+    retval = osrfx2_ctrl_alloc(fx2dev, &fx2dev->leds);
+    if (retval == 0)
+        retval = osrfx2_ctrl_alloc(fx2dev, &fx2dev->segments);
+    if (retval != 0) {
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        return retval;
+    }
 
     /*Set up the endpoint information*/
     for (i = 0; i < intf->cur_altsetting->desc.bNumEndpoints; i++) {
@@ -206,12 +839,12 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         if(usb_endpoint_is_bulk_in(endpoint)) { /*Bulk in*/
             fx2dev->bulk_in_endpointAddr = endpoint->bEndpointAddress;
             fx2dev->bulk_in_endpointInterval = endpoint->bInterval;
-            fx2dev->bulk_in_size = endpoint->wMaxPacketSize;
+            fx2dev->bulk_in_size = usb_endpoint_maxp(endpoint);
         }
         if(usb_endpoint_is_bulk_out(endpoint)) { /*Bulk out*/
             fx2dev->bulk_out_endpointAddr = endpoint->bEndpointAddress;
             fx2dev->bulk_out_endpointInterval = endpoint->bInterval;
-            fx2dev->bulk_out_size = endpoint->wMaxPacketSize;
+            fx2dev->bulk_out_size = usb_endpoint_maxp(endpoint);
         }
         if(usb_endpoint_is_int_in(endpoint)) { /*Interrupt in*/
             fx2dev->int_in_endpointAddr = endpoint->bEndpointAddress;
@@ -229,54 +862,47 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         return retval;
     }
 
+    /*Size bulk transfers for the link speed*/
+    osrfx2_pick_sizes(fx2dev);
+
     /*Initialize interrupts*/
-    pipe = usb_rcvintpipe(fx2dev->udev, fx2dev->int_in_endpointAddr);
-    
     fx2dev->int_in_size = sizeof(fx2dev->switches);
 
-    /*Create interrupt endpoint buffer*/
-    fx2dev->int_in_buffer = kmalloc(fx2dev->int_in_size, GFP_KERNEL);
-    if (!fx2dev->int_in_buffer) {
-        retval = -ENOMEM;
+    /*Create interrupt endpoint urbs and buffers*/
+    retval = osrfx2_int_alloc(fx2dev);
+    if (retval != 0) {
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
-        if (fx2dev) kref_put( &fx2dev->kref, osrfx2_delete );
+        if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
         return retval;
     }
 
-    /*Create interrupt endpoint urb*/
-    fx2dev->int_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (!fx2dev->int_in_urb) {
-        retval = -ENOMEM;
+    /*Initialize bulk endpoint buffers*/
+    retval = osrfx2_rx_alloc(fx2dev);
+    if (retval != 0) {
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
         if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
         return retval;
     }
-
-    /*Fill interrupt endpoint urb*/
-    usb_fill_int_urb(fx2dev->int_in_urb, fx2dev->udev, pipe, fx2dev->int_in_buffer,
-                     fx2dev->int_in_size, interrupt_handler, fx2dev,
-                     fx2dev->int_in_endpointInterval);
-
-    /*Submit urb to USB core*/
-    retval = usb_submit_urb( fx2dev->int_in_urb, GFP_KERNEL );
+    retval = osrfx2_tx_alloc(fx2dev);
     if (retval != 0) {
-        dev_err(&fx2dev->udev->dev, "usb_submit_urb error: %d \n", retval);
+        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
         if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
         return retval;
     }
-
-    /*Initialize bulk endpoint buffers*/
-    fx2dev->bulk_in_buffer = kmalloc(fx2dev->bulk_in_size, GFP_KERNEL);
-    if (!fx2dev->bulk_in_buffer) {
-        retval = -ENOMEM;
+    retval = sysfs_create_group(&intf->dev.kobj, &osrfx2_transfer_group);
+    if (retval != 0) {
         dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
         if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
         return retval;
     }
-    fx2dev->bulk_out_buffer = kmalloc(fx2dev->bulk_out_size, GFP_KERNEL);
-    if (!fx2dev->bulk_out_buffer) {
-        retval = -ENOMEM;
-        dev_err(&intf->dev, "OSR FX2 device probe failed: %d.\n", retval);
+
+    /*Submit urbs to USB core. Everything that can fail is allocated
+      above, so no unwind below has to stop interrupt urbs in flight*/
+    retval = osrfx2_int_start(fx2dev);
+    if (retval != 0) {
+        dev_err(&fx2dev->udev->dev, "usb_submit_urb error: %d \n", retval);
+        osrfx2_int_stop(fx2dev);
+        sysfs_remove_group(&intf->dev.kobj, &osrfx2_transfer_group);
         if (fx2dev) kref_put(&fx2dev->kref, osrfx2_delete);
         return retval;
     }
@@ -287,6 +913,22 @@ static int osrfx2_probe(struct usb_interface * intf, const struct usb_device_id
         usb_set_intfdata(intf, NULL);
     }
 
+    /*Statistics live in debugfs osrfx2/osrfx2_N, named like the device
+      node. N isn't minor - MINOR_BASE with CONFIG_USB_DYNAMIC_MINORS,
+      so take the name usb core gave the class device*/
+    if (retval == 0) {
+        fx2dev->debugfs_dir = debugfs_create_dir(dev_name(intf->usb_dev), osrfx2_debugfs_root);
+        debugfs_create_file("stats", S_IRUSR | S_IWUSR, fx2dev->debugfs_dir, fx2dev, &osrfx2_stats_fops);
+    }
+
+    /*Let idle boards drop to suspend. Switch changes still get through
+      as remote wakeups, and the first I/O afterwards resumes the board*/
+    if (retval == 0 && autosuspend_ms >= 0) {
+        intf->needs_remote_wakeup = 1;
+        pm_runtime_set_autosuspend_delay(&udev->dev, autosuspend_ms);
+        usb_enable_autosuspend(udev);
+    }
+
     dev_info(&intf->dev, "OSR FX2 device now attached\n");
 
     return 0;
@@ -300,19 +942,37 @@ static void osrfx2_disconnect(struct usb_interface * intf) {
 
     /*Give back minor*/
     usb_deregister_dev(intf, &osrfx2_class);
+    debugfs_remove_recursive(fx2dev->debugfs_dir);
 
-    /*Prevent more I/O from starting*/
-    mutex_lock(&fx2dev->io_mutex);
+    /*Prevent more I/O from starting in either direction*/
+    mutex_lock(&fx2dev->rx_mutex);
+    mutex_lock(&fx2dev->tx_mutex);
     fx2dev->interface = NULL;
-    mutex_unlock(&fx2dev->io_mutex);
-
-    /*Release interrupt urb resources*/
-    usb_kill_urb(fx2dev->int_in_urb);
+    mutex_unlock(&fx2dev->tx_mutex);
+    mutex_unlock(&fx2dev->rx_mutex);
+
+    /*usb core drops the PM references still held once we return,
+      pm_gone keeps osrfx2_pm_get and osrfx2_pm_put from touching them*/
+    spin_lock_irq(&fx2dev->pm_lock);
+    fx2dev->pm_gone = 1;
+    spin_unlock_irq(&fx2dev->pm_lock);
+
+    /*Cancel every urb on every pipe, then reset the read-ahead ring and
+      register state and wake anyone still waiting on them*/
+    osrfx2_kill_all(fx2dev);
+    cancel_work_sync(&fx2dev->notify_work);
+    osrfx2_ctrl_stop(fx2dev);
+    osrfx2_rx_stop(fx2dev);
+    wake_up_interruptible(&fx2dev->mmap_wait);
+    wake_up(&fx2dev->FieldEventQueue);
 
     /*Remove sysfs files*/
     device_remove_file(&intf->dev, &dev_attr_switches);
     device_remove_file(&intf->dev, &dev_attr_bargraph);
     device_remove_file(&intf->dev, &dev_attr_7segment);
+    device_remove_file(&intf->dev, &dev_attr_refresh);
+    device_remove_file(&intf->dev, &dev_attr_sync);
+    sysfs_remove_group(&intf->dev.kobj, &osrfx2_transfer_group);
 
     /*Decrement usage count*/
     kref_put( &fx2dev->kref, osrfx2_delete );
@@ -320,37 +980,182 @@ static void osrfx2_disconnect(struct usb_interface * intf) {
     dev_info(&intf->dev, "OSR FX2 disconnected.\n");
 }
 
+/*Stop all I/O for disconnect in one pass. The running flags keep the
+  completion handlers from resubmitting, every anchor is unlinked
+  before any is waited on so the cancellations overlap, and poisoning
+  makes a submit that races with this fail with -EPERM*/
+static void osrfx2_kill_all(struct osrfx2 * fx2dev) {
+    struct usb_anchor *anchors[] = {
+        &fx2dev->int_anchor, &fx2dev->rx_anchor, &fx2dev->tx_anchor,
+        &fx2dev->mmap_anchor, &fx2dev->ctrl_anchor,
+    };
+    unsigned long flags;
+    int i;
+
+    spin_lock_irq(&fx2dev->int_lock);
+    fx2dev->int_running = 0;
+    spin_unlock_irq(&fx2dev->int_lock);
+    spin_lock_irq(&fx2dev->rx_lock);
+    fx2dev->rx_running = 0;
+    spin_unlock_irq(&fx2dev->rx_lock);
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    fx2dev->ctrl_stopped = 1;
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+    cancel_delayed_work_sync(&fx2dev->int_retry);
+
+    spin_lock_irqsave(&fx2dev->tx_lock, flags);
+    if (fx2dev->tx_sg)
+        usb_sg_cancel(fx2dev->tx_sg);
+    spin_unlock_irqrestore(&fx2dev->tx_lock, flags);
+
+    for (i = 0; i < ARRAY_SIZE(anchors); i++)
+        usb_unlink_anchored_urbs(anchors[i]);
+    for (i = 0; i < ARRAY_SIZE(anchors); i++)
+        usb_poison_anchored_urbs(anchors[i]);
+}
+
 /*Delete resources used by this device*/
 static void osrfx2_delete(struct kref * kref) {
     struct osrfx2 *fx2dev = container_of(kref, struct osrfx2, kref);
 
+    osrfx2_rx_free(fx2dev);
+    osrfx2_tx_free(fx2dev);
+    osrfx2_mmap_free(fx2dev);
+    usb_put_intf(fx2dev->pm_intf);
     usb_put_dev(fx2dev->udev);
     
-    if (fx2dev->int_in_urb)
-        usb_free_urb(fx2dev->int_in_urb);
-    if (fx2dev->int_in_buffer)
-        kfree(fx2dev->int_in_buffer);
-    if (fx2dev->bulk_in_buffer)
-        kfree(fx2dev->bulk_in_buffer);
-    if (fx2dev->bulk_out_buffer)
-        kfree(fx2dev->bulk_out_buffer);
+    osrfx2_int_free(fx2dev);
+    if (fx2dev->ctrl_buf)
+        kfree(fx2dev->ctrl_buf);
+    kfree(fx2dev->ctrl_in_setup);
+    usb_free_urb(fx2dev->ctrl_in_urb);
+    osrfx2_ctrl_free(fx2dev, &fx2dev->leds);
+    osrfx2_ctrl_free(fx2dev, &fx2dev->segments);
 
     kfree(fx2dev);
 }
 
-/*Suspend device*/
+/*After disconnect usb core has already dropped what was still held.
+  The put is async since it runs under pm_lock, the idle check that may
+  follow is done by the PM workqueue*/
+static void osrfx2_pm_put(struct osrfx2 * fx2dev) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->pm_lock, flags);
+    if (!fx2dev->pm_gone)
+        usb_autopm_put_interface_async(fx2dev->pm_intf);
+    spin_unlock_irqrestore(&fx2dev->pm_lock, flags);
+}
+
+/*Wake the device and hold it awake until osrfx2_pm_put. With nowait
+  the resume is only started and -EAGAIN returned if it isn't done.
+  Only the reference count changes under pm_lock, the resume itself runs
+  outside it, so callers on different pipes don't wait on each other.
+  Callers hold a kref, which pins pm_intf*/
+static int osrfx2_pm_get(struct osrfx2 * fx2dev, int nowait) {
+    u64 start = ktime_get_ns();
+    int asleep = READ_ONCE(fx2dev->suspended);
+    unsigned long flags;
+    int retval = 0;
+
+    spin_lock_irqsave(&fx2dev->pm_lock, flags);
+    if (fx2dev->pm_gone) /*Disconnect() was called*/
+        retval = -ENODEV;
+    else if (nowait) {
+        retval = usb_autopm_get_interface_async(fx2dev->pm_intf);
+        if (retval == 0 && READ_ONCE(fx2dev->suspended)) {
+            usb_autopm_put_interface_async(fx2dev->pm_intf);
+            retval = -EAGAIN;
+        }
+    }
+    else
+        usb_autopm_get_interface_no_resume(fx2dev->pm_intf);
+    spin_unlock_irqrestore(&fx2dev->pm_lock, flags);
+
+    /*A disconnect during the resume hands the reference to usb core*/
+    if (retval == 0 && !nowait) {
+        retval = pm_runtime_resume(&fx2dev->pm_intf->dev);
+        if (retval < 0) {
+            osrfx2_pm_put(fx2dev);
+            return READ_ONCE(fx2dev->pm_gone) ? -ENODEV : retval;
+        }
+        retval = 0;
+    }
+
+    /*First I/O after idle pays for the resume, keep track of how much*/
+    if (retval == 0 && asleep)
+        osrfx2_stat_latency(fx2dev->stats.wake_lat, start);
+
+    return retval;
+}
+
+/*URBs still in flight after the call that queued them returned*/
+static int osrfx2_pm_busy(struct osrfx2 * fx2dev) {
+    unsigned long flags;
+    int busy;
+
+    /*Queued mmap in buffers count too, suspend would kill them under a
+      reaper that is still waiting for data*/
+    if (atomic_read(&fx2dev->tx_in_flight) ||
+        READ_ONCE(fx2dev->mmap_queued[0]) || READ_ONCE(fx2dev->mmap_queued[1]))
+        return 1;
+
+    spin_lock_irqsave(&fx2dev->ctrl_lock, flags);
+    busy = fx2dev->leds.busy || fx2dev->leds.dirty ||
+           fx2dev->segments.busy || fx2dev->segments.dirty;
+    spin_unlock_irqrestore(&fx2dev->ctrl_lock, flags);
+
+    return busy;
+}
+
+/*Cancel pool and scatter-gather writes in flight. The first one
+  cancelled is latched as -ENOENT in tx_error*/
+static void osrfx2_tx_cancel(struct osrfx2 * fx2dev) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->tx_lock, flags);
+    if (fx2dev->tx_sg || atomic_read(&fx2dev->tx_in_flight))
+        cmpxchg(&fx2dev->tx_error, 0, -ENOENT);
+    if (fx2dev->tx_sg)
+        usb_sg_cancel(fx2dev->tx_sg);
+    spin_unlock_irqrestore(&fx2dev->tx_lock, flags);
+
+    usb_kill_anchored_urbs(&fx2dev->tx_anchor);
+}
+
+/*Suspend device. Autosuspend waits while bulk out, mmap buffers or
+  register writes are in flight, read-ahead and interrupt URBs are
+  restarted on resume*/
 static int osrfx2_suspend(struct usb_interface * intf, pm_message_t message) {
     struct osrfx2 * fx2dev = usb_get_intfdata(intf);
 
-    if (down_interruptible(&fx2dev->sem))
-        return -ERESTARTSYS;
+    if (PMSG_IS_AUTO(message) && osrfx2_pm_busy(fx2dev))
+        return -EBUSY;
 
-    fx2dev->suspended = 1;
+    /*usb core never runs suspend and resume of an interface at the
+      same time, so they need no lock of their own*/
+    WRITE_ONCE(fx2dev->suspended, 1);
+    if (PMSG_IS_AUTO(message))
+        atomic64_inc(&fx2dev->stats.pm_suspends);
      
-    /*Stop the interrupt pipe read urb*/
-    usb_kill_urb(fx2dev->int_in_urb);
+    /*Stop the interrupt pipe read urbs and any pending retry*/
+    osrfx2_int_stop(fx2dev);
+
+    /*Stop read-ahead. Completed buffers are kept for the reader*/
+    usb_kill_anchored_urbs(&fx2dev->rx_anchor);
 
-    up(&fx2dev->sem);
+    /*Only a system suspend finds mmap buffers queued, they complete
+      with -ENOENT*/
+    usb_kill_anchored_urbs(&fx2dev->mmap_anchor);
+
+    /*Hold register writes, the latest values go out on resume*/
+    osrfx2_ctrl_stop(fx2dev);
+
+    /*Only a system suspend gets here with bulk out writes in flight.
+      They are cancelled rather than left running over a suspended port,
+      and fsync reports -EIO for them*/
+    if (!PMSG_IS_AUTO(message))
+        osrfx2_tx_cancel(fx2dev);
 
     return 0;
 }
@@ -361,13 +1166,12 @@ static int osrfx2_resume(struct usb_interface * intf) {
     int retval;
     struct osrfx2 * fx2dev = usb_get_intfdata(intf);
 
-    if (down_interruptible(&fx2dev->sem))
-        return -ERESTARTSYS;
-    
-    fx2dev->suspended = 0;
+    WRITE_ONCE(fx2dev->suspended, 0);
+    smp_mb(); /*Before reading rx_running, pairs with osrfx2_poll_rx_start*/
+    atomic64_inc(&fx2dev->stats.pm_resumes);
      
-     /*Re-start the interrupt pipe read urb*/
-    retval = usb_submit_urb( fx2dev->int_in_urb, GFP_KERNEL );
+     /*Re-start the interrupt pipe read urbs. Any that fail are retried*/
+    retval = osrfx2_int_start(fx2dev);
     
     if (retval) {
         dev_err(&intf->dev, "%s - usb_submit_urb failed %d\n", __FUNCTION__, retval);
@@ -381,8 +1185,13 @@ static int osrfx2_resume(struct usb_interface * intf) {
 
         }
     }
-    
-    up(&fx2dev->sem);
+
+    /*Re-start read-ahead if a reader had it running*/
+    if (READ_ONCE(fx2dev->rx_running))
+        osrfx2_rx_start(fx2dev);
+
+    /*Send register writes held while suspended*/
+    osrfx2_ctrl_start(fx2dev);
 
     return 0;
 }
@@ -391,6 +1200,7 @@ static int osrfx2_resume(struct usb_interface * intf) {
 static int osrfx2_open(struct inode * inode, struct file * file) {
     struct usb_interface *interface;
     struct osrfx2        *fx2dev;
+    struct osrfx2_file   *client;
     int retval;
     int flags;
     
@@ -400,12 +1210,24 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
     fx2dev = usb_get_intfdata(interface);
     if (!fx2dev) return -ENODEV;
 
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client) return -ENOMEM;
+
+    /*Resetting the bulk pipes needs the device awake*/
+    retval = osrfx2_pm_get(fx2dev, 0);
+    if (retval) {
+        kfree(client);
+        return retval;
+    }
+
     /*Serialize access to each of the bulk pipes*/
     flags = (file->f_flags & O_ACCMODE);
 
     if ((flags == O_WRONLY) || (flags == O_RDWR)) {
         if (!atomic_dec_and_test( &fx2dev->bulk_write_available )) {
             atomic_inc( &fx2dev->bulk_write_available );
+            osrfx2_pm_put(fx2dev);
+            kfree(client);
             return -EBUSY;
         }
 
@@ -422,6 +1244,8 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
             atomic_inc( &fx2dev->bulk_read_available );
             if (flags == O_RDWR)
                 atomic_inc( &fx2dev->bulk_write_available );
+            osrfx2_pm_put(fx2dev);
+            kfree(client);
             return -EBUSY;
         }
 
@@ -435,230 +1259,2289 @@ static int osrfx2_open(struct inode * inode, struct file * file) {
 
     /*Set this device as non-seekable*/
     retval = nonseekable_open(inode, file);
-    if (retval) return retval;
+    if (retval) {
+        if ((flags == O_WRONLY) || (flags == O_RDWR))
+            atomic_inc( &fx2dev->bulk_write_available );
+        if ((flags == O_RDONLY) || (flags == O_RDWR))
+            atomic_inc( &fx2dev->bulk_read_available );
+        osrfx2_pm_put(fx2dev);
+        kfree(client);
+        return retval;
+    }
 
     /*Increment our usage count for the device*/
     kref_get(&fx2dev->kref);
 
-    /*Save pointer to device instance in the file's private structure*/
-    file->private_data = fx2dev;
+#ifdef FMODE_NOWAIT
+    /*read_iter and write_iter honor IOCB_NOWAIT*/
+    file->f_mode |= FMODE_NOWAIT;
+#endif
+
+    /*Only switch changes from now on are reported*/
+    client->fx2dev      = fx2dev;
+    osrfx2_switches(fx2dev, &client->switch_seq);
+    INIT_LIST_HEAD(&client->event_node);
+    INIT_KFIFO(client->events);
+    mutex_init(&client->event_mutex);
+    client->claimed_out = ((flags == O_WRONLY) || (flags == O_RDWR));
+    client->claimed_in  = ((flags == O_RDONLY) || (flags == O_RDWR));
+
+    /*A new writer doesn't see failures of the last one*/
+    if (client->claimed_out)
+        WRITE_ONCE(fx2dev->tx_error, 0);
+
+    /*A new reader starts out waking on every byte of a prefetched stream*/
+    if (client->claimed_in) {
+        spin_lock_irq(&fx2dev->rx_lock);
+        fx2dev->rx_lowat    = 1;
+        fx2dev->rx_want     = 1;
+        fx2dev->rx_msg      = 0;
+        fx2dev->rx_prefetch = 1;
+        spin_unlock_irq(&fx2dev->rx_lock);
+    }
+
+    /*Save pointer to the file state in the file's private structure*/
+    file->private_data = client;
+
+    osrfx2_pm_put(fx2dev);
 
     return 0;
 }
 
 /*Release device*/
 static int osrfx2_release(struct inode * inode, struct file * file) {
+    struct osrfx2_file * client;
     struct osrfx2 * fx2dev;
-    int flags;
 
-    fx2dev = (struct osrfx2 *)file->private_data;
-    if (!fx2dev)
+    client = (struct osrfx2_file *)file->private_data;
+    if (!client)
         return -ENODEV;
+    fx2dev = client->fx2dev;
 
     /*Release any bulk_[write|read]_available serialization*/
-    flags = (file->f_flags & O_ACCMODE);
-
-    if ((flags == O_WRONLY) || (flags == O_RDWR))
+    if (client->claimed_out) {
+        /*Let queued writes drain, but don't let a stuck pipe hold up close*/
+        if (!usb_wait_anchor_empty_timeout(&fx2dev->tx_anchor, RELEASE_TIMEOUT))
+            usb_kill_anchored_urbs(&fx2dev->tx_anchor);
+        osrfx2_mmap_reset(fx2dev, 1);
         atomic_inc( &fx2dev->bulk_write_available );
+    }
 
-    if ((flags == O_RDONLY) || (flags == O_RDWR))
+    if (client->claimed_in) {
+        /*Nobody is left to consume read-ahead data*/
+        osrfx2_rx_stop(fx2dev);
+        osrfx2_mmap_reset(fx2dev, 0);
         atomic_inc( &fx2dev->bulk_read_available );
+    }
+
+    /*Stop receiving switch events*/
+    if (client->event_mode) {
+        spin_lock_irq(&fx2dev->event_lock);
+        list_del(&client->event_node);
+        spin_unlock_irq(&fx2dev->event_lock);
+    }
  
     /*Decrement the ref-count on the device instance*/
     kref_put(&fx2dev->kref, osrfx2_delete);
+    kfree(client);
 
     return 0;
 }
 
-/*Read from /dev/osrfx2_0*/
-static ssize_t osrfx2_read(struct file * file, char * buffer, size_t count, loff_t * ppos) {
-    struct osrfx2 *fx2dev;
-    int retval = 0;
-    int bytes_read;
-    int pipe;
+/*True once no pool write and no queued mmap out buffer is in flight*/
+static int osrfx2_tx_idle(struct osrfx2 * fx2dev) {
+    return !atomic_read(&fx2dev->tx_in_flight) && !READ_ONCE(fx2dev->mmap_queued[1]);
+}
 
-    fx2dev = (struct osrfx2 *)file->private_data;
+/*Wait until no pool write or mmap out buffer is in flight, at most
+  timeout jiffies or without limit if timeout is 0. Returns the first
+  write failure since the last call and clears it, or -ETIMEDOUT,
+  -ERESTARTSYS, -ENODEV*/
+static int osrfx2_tx_drain(struct osrfx2 * fx2dev, long timeout) {
+    long left;
+
+    if (timeout)
+        left = wait_event_interruptible_timeout(fx2dev->tx_wait,
+                   osrfx2_tx_idle(fx2dev), timeout);
+    else
+        left = wait_event_interruptible(fx2dev->tx_wait,
+                   osrfx2_tx_idle(fx2dev)) ? -ERESTARTSYS : 1;
+    if (left < 0)
+        return left;
+    if (!left)
+        return -ETIMEDOUT;
+
+    if (!xchg(&fx2dev->tx_error, 0))
+        return 0;
+
+    return READ_ONCE(fx2dev->interface) ? -EIO : -ENODEV;
+}
 
-    /*Initialize pipe*/
-    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr),
+/*Called on every close of a file descriptor. The writer waits for its
+  data to go out, bounded so a stuck pipe can't hang close*/
+static int osrfx2_flush(struct file * file, fl_owner_t id) {
+    struct osrfx2_file *client = file->private_data;
 
-    /*Do a blocking bulk read to get data from the device*/
-    retval = usb_bulk_msg(fx2dev->udev, pipe, fx2dev->bulk_in_buffer, min(fx2dev->bulk_in_size, count),
-                          &bytes_read, 10000);
+    if (!client || !client->claimed_out)
+        return 0;
 
-    /*If the read was successful, copy the data to userspace */
-    if (!retval) {
-        if (copy_to_user(buffer, fx2dev->bulk_in_buffer, bytes_read))
-            retval = -EFAULT;
-        else
-            retval = bytes_read;        
-        
-        /*Increment the pending_data counter by the byte count received*/
-        fx2dev->pending_data -= retval;
-    }
+    return osrfx2_tx_drain(client->fx2dev, msecs_to_jiffies(RELEASE_TIMEOUT));
+}
 
-    return retval;
+/*Completion barrier for pipelined writes: returns once every write and
+  mmap out buffer submitted so far has finished, with -EIO if any of
+  them failed*/
+static int osrfx2_fsync(struct file * file, loff_t start, loff_t end, int datasync) {
+    struct osrfx2_file *client = file->private_data;
+
+    if (!client->claimed_out)
+        return -EBADF;
+
+    return osrfx2_tx_drain(client->fx2dev, 0);
 }
 
-/*Write to bulk endpoint*/
-static ssize_t osrfx2_write(struct file * file, const char * user_buffer, size_t count, loff_t * ppos) {
-    struct osrfx2 *fx2dev;
-    struct urb *urb = NULL;
-    char *buf = NULL;
-    int pipe;
-    int retval = 0;
+/*Packets per URB for a pipe: the module parameter if set, else the
+  default for the link speed, capped at max_urb_size*/
+static int osrfx2_urb_packets(struct osrfx2 * fx2dev, int packets, size_t maxp) {
+    int limit = max_t(int, max_urb_size / maxp, 1);
 
-    fx2dev = (struct osrfx2 *)file->private_data;
+    if (packets <= 0)
+        packets = fx2dev->high_speed ? HS_URB_PACKETS : FS_URB_PACKETS;
 
-    if (!count) return count;
- 
-    /*Create a urb*/
-    urb = usb_alloc_urb(0, GFP_KERNEL);
+    return min(packets, limit);
+}
 
-    if(!urb) {
-        retval = -ENOMEM;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+/*Choose read-ahead and bulk out pool sizes. The firmware reports the
+  link speed, fall back on what usb core negotiated if it can't*/
+static void osrfx2_pick_sizes(struct osrfx2 * fx2dev) {
+    unsigned char value;
+    int urbs, retval;
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+    retval = osrfx2_ctrl_in(fx2dev, IS_HIGH_SPEED, &value);
+    mutex_unlock(&fx2dev->ctrl_mutex);
+
+    if (retval == 0)
+        fx2dev->high_speed = (value != 0);
+    else
+        fx2dev->high_speed = (fx2dev->udev->speed >= USB_SPEED_HIGH);
+
+    urbs = fx2dev->high_speed ? HS_URBS : FS_URBS;
+
+    fx2dev->rx_count = read_urbs > 0 ? read_urbs : urbs;
+    fx2dev->rx_size  = fx2dev->bulk_in_size *
+                       osrfx2_urb_packets(fx2dev, read_packets, fx2dev->bulk_in_size);
+    fx2dev->tx_count = write_urbs > 0 ? write_urbs : urbs;
+    fx2dev->tx_size  = fx2dev->bulk_out_size *
+                       osrfx2_urb_packets(fx2dev, write_packets, fx2dev->bulk_out_size);
+
+    dev_info(&fx2dev->udev->dev, "%s speed: %d x %zu byte reads, %d x %zu byte writes\n",
+             fx2dev->high_speed ? "high" : "full",
+             fx2dev->rx_count, fx2dev->rx_size, fx2dev->tx_count, fx2dev->tx_size);
+}
 
-    /*Create urb buffer*/
-    buf = usb_alloc_coherent(fx2dev->udev, count, GFP_KERNEL, &urb->transfer_dma);
+/*Allocate rx_ring and the read-ahead buffers. All buffers start out idle*/
+static int osrfx2_rx_alloc(struct osrfx2 * fx2dev) {
+    struct osrfx2_rx *rx;
+    int pipe, i;
 
-    if(!buf) {
-        retval = -ENOMEM;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+    fx2dev->rx_ring_size = roundup_pow_of_two(max_t(size_t, rx_ring_size, fx2dev->rx_size));
+    fx2dev->rx_ring = kvmalloc(fx2dev->rx_ring_size, GFP_KERNEL);
+    if (!fx2dev->rx_ring)
+        return -ENOMEM;
+    fx2dev->rx_lowat = 1;
+    fx2dev->rx_want  = 1;
 
-    /*Copy the data to the buffer*/
-    if(copy_from_user(buf, user_buffer, count)) {
-        retval = -EFAULT;
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+    fx2dev->rx = kcalloc(fx2dev->rx_count, sizeof(*fx2dev->rx), GFP_KERNEL);
+    if (!fx2dev->rx)
+        return -ENOMEM;
 
-    /*Initialize the urb*/
-    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
-    usb_fill_bulk_urb( urb, fx2dev->udev, pipe, buf, count, write_bulk_callback, fx2dev);
-    urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+    pipe = usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr);
 
-    /*Send the data out the bulk port*/
-    retval = usb_submit_urb(urb, GFP_KERNEL);
+    for (i = 0; i < fx2dev->rx_count; i++) {
+        rx = &fx2dev->rx[i];
+        rx->fx2dev = fx2dev;
 
-    if (retval) {
-        dev_err(&fx2dev->interface->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
-        usb_free_coherent(fx2dev->udev, count, buf, urb->transfer_dma);
-        usb_free_urb(urb);
-        return retval;
-    }
+        rx->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!rx->urb)
+            return -ENOMEM;
 
-    /*Increment the pending_data counter by the byte count sent*/
-    fx2dev->pending_data += count;
-     
-    /*Release the reference to this urb*/
-    usb_free_urb(urb);
+        rx->buffer = usb_alloc_coherent(fx2dev->udev, fx2dev->rx_size,
+                                        GFP_KERNEL, &rx->urb->transfer_dma);
+        if (!rx->buffer)
+            return -ENOMEM;
 
-    return count;
-}
+        usb_fill_bulk_urb(rx->urb, fx2dev->udev, pipe, rx->buffer,
+                          fx2dev->rx_size, read_bulk_callback, rx);
+        rx->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
-static void write_bulk_callback(struct urb * urb) {
-    struct osrfx2 *fx2dev = (struct osrfx2 *)urb->context;
- 
-    /*  Filter sync and async unlink events as non-errors*/
-    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
-        dev_err(&fx2dev->interface->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
- 
-    /*Free the spent buffer*/
-    usb_free_coherent( urb->dev, urb->transfer_buffer_length, urb->transfer_buffer, urb->transfer_dma );
-}
+        list_add_tail(&rx->list, &fx2dev->rx_idle);
+    }
 
-/*DIP switch interrupt handler*/
-static void interrupt_handler(struct urb * urb) {
-    struct osrfx2 *fx2dev = urb->context;
-    unsigned char *buf = urb->transfer_buffer;
-    int retval;
+    return 0;
+}
 
-    if (urb->status == 0) {
-        fx2dev->switches = *buf; /*Get new switch state*/
+/*Free the read-ahead ring. Nothing may be in flight*/
+static void osrfx2_rx_free(struct osrfx2 * fx2dev) {
+    struct osrfx2_rx *rx;
+    int i;
 
-        wake_up(&(fx2dev->FieldEventQueue)); /*Wake-up any requests enqueued*/
+    kvfree(fx2dev->rx_ring);
+    fx2dev->rx_ring = NULL;
 
-        retval = usb_submit_urb(urb, GFP_ATOMIC); /*Restart interrupt urb*/
-        if (retval != 0)
-            dev_err(&urb->dev->dev, "%s - error %d submitting interrupt urb\n", __FUNCTION__, retval);
+    if (!fx2dev->rx)
+        return;
 
-        return; /*Success*/   
+    for (i = 0; i < fx2dev->rx_count; i++) {
+        rx = &fx2dev->rx[i];
+        if (!rx->urb)
+            break;
+        if (rx->buffer)
+            usb_free_coherent(fx2dev->udev, fx2dev->rx_size,
+                              rx->buffer, rx->urb->transfer_dma);
+        usb_free_urb(rx->urb);
     }
 
-    /*Error*/
-    dev_err(&urb->dev->dev, "%s - non-zero urb status received: %d\n", __FUNCTION__, urb->status);
+    kfree(fx2dev->rx);
+    fx2dev->rx = NULL;
 }
 
-/*Retreive the values of the switches*/
-static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf) {
-    struct usb_interface   *intf   = to_usb_interface(dev);
-    struct osrfx2          *fx2dev = usb_get_intfdata(intf);    
+/*Submit one read-ahead buffer. Caller holds rx_lock*/
+static int osrfx2_rx_submit(struct osrfx2 * fx2dev, struct osrfx2_rx * rx) {
     int retval;
 
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s", /*left sw --> right sw*/
-                    (fx2dev->switches & 0x80) ? "1" : "0",
-                    (fx2dev->switches & 0x40) ? "1" : "0",
-                    (fx2dev->switches & 0x20) ? "1" : "0",
-                    (fx2dev->switches & 0x10) ? "1" : "0",
-                    (fx2dev->switches & 0x08) ? "1" : "0",
-                    (fx2dev->switches & 0x04) ? "1" : "0",
-                    (fx2dev->switches & 0x02) ? "1" : "0",
-                    (fx2dev->switches & 0x01) ? "1" : "0");
+    rx->length = 0;
+    rx->offset = 0;
+    usb_anchor_urb(rx->urb, &fx2dev->rx_anchor);
 
-    return retval;
+    trace_osrfx2_submit(rx->urb, rx->urb->pipe, rx->urb->transfer_buffer_length, 0);
+    retval = usb_submit_urb(rx->urb, GFP_ATOMIC);
+    if (retval) {
+        usb_unanchor_urb(rx->urb);
+        if (retval != -ENODEV && retval != -EPERM)
+            dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n",
+                    __FUNCTION__, retval);
+        return retval;
+    }
+    osrfx2_stat_submit(fx2dev, STAT_EP_BULK_IN, rx->urb->transfer_buffer_length);
+
+    return 0;
 }
 
-/*Gets the LED bargraph status on the device*/
-static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf) {
-    struct usb_interface  *intf   = to_usb_interface(dev);
-    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
-    int retval;
-   
-    if (fx2dev->suspended) {
-        return sprintf(buf, "S ");   /*Device is suspended*/
+/*True while completed buffers should go straight back out. Without
+  prefetch that is only while somebody waits for data. Caller holds rx_lock*/
+static int osrfx2_rx_wanted(struct osrfx2 * fx2dev) {
+    return fx2dev->rx_running && (fx2dev->rx_prefetch || fx2dev->rx_pull);
+}
+
+/*Submit every idle read-ahead buffer*/
+static void osrfx2_rx_start(struct osrfx2 * fx2dev) {
+    struct osrfx2_rx *rx;
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->rx_lock, flags);
+    fx2dev->rx_running = 1;
+
+    while (osrfx2_rx_wanted(fx2dev) && !list_empty(&fx2dev->rx_idle)) {
+        rx = list_first_entry(&fx2dev->rx_idle, struct osrfx2_rx, list);
+        list_del(&rx->list);
+
+        if (osrfx2_rx_submit(fx2dev, rx)) {
+            list_add(&rx->list, &fx2dev->rx_idle);
+            break;
+        }
     }
 
-    fx2dev->leds = 0;
+    spin_unlock_irqrestore(&fx2dev->rx_lock, flags);
+}
 
-    /*Get LED values*/
-    retval = usb_control_msg(fx2dev->udev, usb_rcvctrlpipe(fx2dev->udev, 0),
-                             READ_LEDS, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->leds, sizeof(fx2dev->leds),
-                             USB_CTRL_GET_TIMEOUT);
+/*Bytes in rx_ring. Caller holds rx_lock*/
+static size_t osrfx2_rx_used(struct osrfx2 * fx2dev) {
+    return fx2dev->rx_head - fx2dev->rx_tail;
+}
 
-    /*Fill buffer with LED status*/
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
-                     (fx2dev->leds & 0x10) ? "1" : "0",
-                     (fx2dev->leds & 0x08) ? "1" : "0",
-                     (fx2dev->leds & 0x04) ? "1" : "0",
-                     (fx2dev->leds & 0x02) ? "1" : "0",
-                     (fx2dev->leds & 0x01) ? "1" : "0",
-                     (fx2dev->leds & 0x80) ? "1" : "0",
-                     (fx2dev->leds & 0x40) ? "1" : "0",
-                     (fx2dev->leds & 0x20) ? "1" : "0");
+/*Append to rx_ring, which has room. Caller holds rx_lock*/
+static void osrfx2_rx_put(struct osrfx2 * fx2dev, const unsigned char * data, size_t len) {
+    size_t off = fx2dev->rx_head & (fx2dev->rx_ring_size - 1);
+    size_t first = min(len, fx2dev->rx_ring_size - off);
 
-    return retval;
+    memcpy(fx2dev->rx_ring + off, data, first);
+    memcpy(fx2dev->rx_ring, data + first, len - first);
+    fx2dev->rx_head += len;
 }
 
-/*Sets the LED bargraph on the device*/
+/*Message ends queued in rx_ring. Caller holds rx_lock*/
+static unsigned int osrfx2_rx_msgs(struct osrfx2 * fx2dev) {
+    return fx2dev->rx_mark_head - fx2dev->rx_mark_tail;
+}
+
+/*True if rx_ring has room for a completed buffer, and for its message
+  end if it has one. Caller holds rx_lock*/
+static int osrfx2_rx_fits(struct osrfx2 * fx2dev, struct osrfx2_rx * rx) {
+    return fx2dev->rx_ring_size - osrfx2_rx_used(fx2dev) >= rx->length &&
+           !(rx->end && osrfx2_rx_msgs(fx2dev) == RX_MARKS);
+}
+
+/*Copy a completed buffer into rx_ring, which has room, and record the
+  message it ends. A ZLP after a message that already ended on a short
+  packet adds nothing. Caller holds rx_lock*/
+static void osrfx2_rx_take(struct osrfx2 * fx2dev, struct osrfx2_rx * rx) {
+    osrfx2_rx_put(fx2dev, rx->buffer, rx->length);
+
+    if (rx->end && fx2dev->rx_head != fx2dev->rx_msg_end) {
+        fx2dev->rx_marks[fx2dev->rx_mark_head++ & (RX_MARKS - 1)] = fx2dev->rx_head;
+        fx2dev->rx_msg_end = fx2dev->rx_head;
+    }
+}
+
+/*Move parked buffers into rx_ring as far as it has room and make them
+  idle again. Caller holds rx_lock*/
+static void osrfx2_rx_unpark(struct osrfx2 * fx2dev) {
+    struct osrfx2_rx *rx;
+
+    while (!list_empty(&fx2dev->rx_done)) {
+        rx = list_first_entry(&fx2dev->rx_done, struct osrfx2_rx, list);
+        if (!osrfx2_rx_fits(fx2dev, rx))
+            break;
+
+        osrfx2_rx_take(fx2dev, rx);
+        list_move_tail(&rx->list, &fx2dev->rx_idle);
+    }
+}
+
+/*Cancel read-ahead and throw away any data not yet read*/
+static void osrfx2_rx_stop(struct osrfx2 * fx2dev) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->rx_lock, flags);
+    fx2dev->rx_running = 0;
+    spin_unlock_irqrestore(&fx2dev->rx_lock, flags);
+
+    usb_kill_anchored_urbs(&fx2dev->rx_anchor);
+
+    spin_lock_irqsave(&fx2dev->rx_lock, flags);
+    list_splice_tail_init(&fx2dev->rx_done, &fx2dev->rx_idle);
+    fx2dev->rx_head  = 0;
+    fx2dev->rx_tail  = 0;
+    fx2dev->rx_error = 0;
+    fx2dev->rx_mark_head = 0;
+    fx2dev->rx_mark_tail = 0;
+    fx2dev->rx_msg_end   = 0;
+    spin_unlock_irqrestore(&fx2dev->rx_lock, flags);
+
+    /*Let any waiting reader see the ring is down*/
+    wake_up_interruptible(&fx2dev->rx_wait);
+}
+
+/*Throw away data not yet read and switch message framing. Unlike
+  osrfx2_rx_stop the ring stays up, so a reader blocked in read keeps
+  waiting. Poisoning keeps completions from resubmitting meanwhile.
+  Completed urbs leave the anchor, so each one is unpoisoned by hand.
+  Caller holds rx_mutex and has checked interface, so disconnect can't
+  poison the anchor in between*/
+static void osrfx2_rx_reset(struct osrfx2 * fx2dev, int msg) {
+    int i;
+
+    usb_poison_anchored_urbs(&fx2dev->rx_anchor);
+    usb_unpoison_anchored_urbs(&fx2dev->rx_anchor);
+    for (i = 0; i < fx2dev->rx_count; i++)
+        usb_unpoison_urb(fx2dev->rx[i].urb);
+
+    spin_lock_irq(&fx2dev->rx_lock);
+    list_splice_tail_init(&fx2dev->rx_done, &fx2dev->rx_idle);
+    fx2dev->rx_head  = 0;
+    fx2dev->rx_tail  = 0;
+    fx2dev->rx_error = 0;
+    fx2dev->rx_mark_head = 0;
+    fx2dev->rx_mark_tail = 0;
+    fx2dev->rx_msg_end   = 0;
+    fx2dev->rx_msg       = msg;
+    spin_unlock_irq(&fx2dev->rx_lock);
+
+    if (fx2dev->rx_running)
+        osrfx2_rx_start(fx2dev);
+}
+
+/*True when a reader waiting for want bytes has something to act on.
+  In message mode want is ignored and a whole message is needed. Parked
+  buffers mean rx_ring is as full as it gets. Caller holds rx_lock*/
+static int osrfx2_rx_ready_locked(struct osrfx2 * fx2dev, size_t want) {
+    if (fx2dev->rx_msg ? osrfx2_rx_msgs(fx2dev) != 0 : osrfx2_rx_used(fx2dev) >= want)
+        return 1;
+    return !list_empty(&fx2dev->rx_done) || fx2dev->rx_error || !fx2dev->rx_running;
+}
+
+static int osrfx2_rx_ready(struct osrfx2 * fx2dev, size_t want) {
+    unsigned long flags;
+    int ready;
+
+    spin_lock_irqsave(&fx2dev->rx_lock, flags);
+    ready = osrfx2_rx_ready_locked(fx2dev, want);
+    spin_unlock_irqrestore(&fx2dev->rx_lock, flags);
+
+    return ready;
+}
+
+/*Read switch events queued for this file, whole records only*/
+static ssize_t osrfx2_read_events(struct osrfx2_file * client, struct kiocb * iocb,
+                                  struct iov_iter * to, int nonblock) {
+    struct osrfx2 *fx2dev = client->fx2dev;
+    struct osrfx2_switch_event ev[16];
+    size_t count = iov_iter_count(to);
+    size_t bytes = 0;
+    unsigned int n;
+    int retval = 0;
+
+    if (count < sizeof(ev[0]))
+        return -EINVAL;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&client->event_mutex))
+            return -EAGAIN;
+    }
+    else {
+        retval = mutex_lock_interruptible(&client->event_mutex);
+        if (retval) return retval;
+    }
+
+    /*Wait for the interrupt handler to queue a change*/
+    while (kfifo_is_empty(&client->events)) {
+        mutex_unlock(&client->event_mutex);
+
+        if (!fx2dev->interface) /*Disconnect() was called*/
+            return -ENODEV;
+        if (nonblock)
+            return -EAGAIN;
+
+        retval = wait_event_interruptible(fx2dev->FieldEventQueue,
+                                          !kfifo_is_empty(&client->events) || !fx2dev->interface);
+        if (retval) return retval;
+
+        retval = mutex_lock_interruptible(&client->event_mutex);
+        if (retval) return retval;
+    }
+
+    while (count - bytes >= sizeof(ev[0])) {
+        n = kfifo_out(&client->events, ev, min_t(size_t, ARRAY_SIZE(ev), (count - bytes) / sizeof(ev[0])));
+        if (!n)
+            break;
+        if (copy_to_iter(ev, n * sizeof(ev[0]), to) != n * sizeof(ev[0])) {
+            retval = -EFAULT;
+            break;
+        }
+        bytes += n * sizeof(ev[0]);
+    }
+
+    mutex_unlock(&client->event_mutex);
+    return bytes ? bytes : retval;
+}
+
+/*Timeout in jiffies for a read on this file. The adaptive one is the
+  smoothed wait plus four deviations, as for TCP retransmits, doubled
+  per timeout in a row and kept within READ_TIMEOUT_MIN and READ_TIMEOUT.
+  Caller holds rx_mutex*/
+static long osrfx2_read_timeout(struct osrfx2 * fx2dev, struct osrfx2_file * client) {
+    int ms = client->read_timeout ? client->read_timeout : READ_ONCE(read_timeout_ms);
+    long us;
+
+    if (ms > 0)
+        return msecs_to_jiffies(ms);
+    if (ms != OSRFX2_READ_TIMEOUT_ADAPTIVE || !fx2dev->rx_srtt_us)
+        return msecs_to_jiffies(READ_TIMEOUT);
+
+    us = min((fx2dev->rx_srtt_us + 4 * fx2dev->rx_rttvar_us) << fx2dev->rx_backoff,
+             (long)READ_TIMEOUT * USEC_PER_MSEC);
+    return max(usecs_to_jiffies(us), msecs_to_jiffies(READ_TIMEOUT_MIN));
+}
+
+/*Feed the adaptive timeout with the time a read waited for its data.
+  Caller holds rx_mutex*/
+static void osrfx2_read_sample(struct osrfx2 * fx2dev, u64 start) {
+    long us = clamp_t(long, (ktime_get_ns() - start) / NSEC_PER_USEC, 1, (long)READ_TIMEOUT * USEC_PER_MSEC);
+    long err;
+
+    if (!fx2dev->rx_srtt_us) {
+        WRITE_ONCE(fx2dev->rx_srtt_us, us);
+        WRITE_ONCE(fx2dev->rx_rttvar_us, us / 2);
+    }
+    else {
+        err = us - fx2dev->rx_srtt_us;
+        WRITE_ONCE(fx2dev->rx_srtt_us, max(fx2dev->rx_srtt_us + err / 8, 1L));
+        WRITE_ONCE(fx2dev->rx_rttvar_us, fx2dev->rx_rttvar_us + (abs(err) - fx2dev->rx_rttvar_us) / 4);
+    }
+    WRITE_ONCE(fx2dev->rx_backoff, 0);
+}
+
+/*Bulk in part of read_iter, called with the device awake*/
+static ssize_t osrfx2_read_bulk(struct osrfx2 * fx2dev, struct kiocb * iocb, struct iov_iter * to, int nonblock) {
+    struct osrfx2_file *client = iocb->ki_filp->private_data;
+    size_t count = iov_iter_count(to);
+    size_t bytes_read = 0;
+    size_t want, tail, avail, off, chunk, copied;
+    long timeout;
+    u64 start;
+    int retval = 0;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!mutex_trylock(&fx2dev->rx_mutex))
+            return -EAGAIN;
+    }
+    else {
+        retval = mutex_lock_interruptible(&fx2dev->rx_mutex);
+        if (retval) return retval;
+    }
+
+    if (!fx2dev->interface) { /*Disconnect() was called*/
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    /*First read starts the read-ahead ring, unless the mmap ring owns the pipe*/
+    if (!fx2dev->rx_running) {
+        if (osrfx2_mmap_in_busy(fx2dev)) {
+            retval = -EBUSY;
+            goto exit;
+        }
+        osrfx2_rx_start(fx2dev);
+    }
+
+    /*Wait until rx_ring holds the low watermark, or the whole request if
+      that is smaller*/
+    want = min(count, fx2dev->rx_lowat);
+    while (!osrfx2_rx_ready(fx2dev, want) || !fx2dev->rx_running) {
+        if (!fx2dev->rx_running) {
+            retval = -ENODEV;
+            goto exit;
+        }
+        if (nonblock) {
+            if (osrfx2_rx_ready(fx2dev, 1))
+                break;
+            /*Without prefetch the data has to be asked for, retry later*/
+            if (!fx2dev->rx_prefetch) {
+                spin_lock_irq(&fx2dev->rx_lock);
+                fx2dev->rx_pull = 1;
+                spin_unlock_irq(&fx2dev->rx_lock);
+                osrfx2_rx_start(fx2dev);
+            }
+            retval = -EAGAIN;
+            goto exit;
+        }
+
+        /*Without prefetch nothing is in flight until somebody asks*/
+        spin_lock_irq(&fx2dev->rx_lock);
+        fx2dev->rx_want = want;
+        fx2dev->rx_pull = 1;
+        spin_unlock_irq(&fx2dev->rx_lock);
+        if (!fx2dev->rx_prefetch)
+            osrfx2_rx_start(fx2dev);
+
+        timeout = osrfx2_read_timeout(fx2dev, client);
+        start = ktime_get_ns();
+        mutex_unlock(&fx2dev->rx_mutex);
+        timeout = wait_event_interruptible_timeout(fx2dev->rx_wait, osrfx2_rx_ready(fx2dev, want),
+                                                   timeout);
+        spin_lock_irq(&fx2dev->rx_lock);
+        fx2dev->rx_want = fx2dev->rx_lowat;
+        spin_unlock_irq(&fx2dev->rx_lock);
+        if (timeout < 0)
+            return timeout;
+
+        retval = mutex_lock_interruptible(&fx2dev->rx_mutex);
+        if (retval) return retval;
+
+        if (!fx2dev->interface) {
+            retval = -ENODEV;
+            goto exit;
+        }
+        /*Short of the watermark on timeout, hand over what did arrive*/
+        if (!timeout && !osrfx2_rx_ready(fx2dev, want)) {
+            if (fx2dev->rx_backoff < READ_BACKOFF_MAX)
+                WRITE_ONCE(fx2dev->rx_backoff, fx2dev->rx_backoff + 1);
+            if (osrfx2_rx_ready(fx2dev, 1))
+                break;
+            retval = -ETIMEDOUT;
+            goto exit;
+        }
+        osrfx2_read_sample(fx2dev, start);
+    }
+
+    /*Report a failed transfer once all data ahead of it was read, then
+      restart the failed buffers*/
+    spin_lock_irq(&fx2dev->rx_lock);
+    if (fx2dev->rx_error && !osrfx2_rx_used(fx2dev) && list_empty(&fx2dev->rx_done)) {
+        retval = fx2dev->rx_error;
+        fx2dev->rx_error = 0;
+        spin_unlock_irq(&fx2dev->rx_lock);
+        osrfx2_rx_start(fx2dev);
+        goto exit;
+    }
+    tail = fx2dev->rx_tail;
+    avail = osrfx2_rx_used(fx2dev);
+    /*Stop at the end of the oldest message. A short read leaves the rest
+      of it for the next read*/
+    if (fx2dev->rx_msg && osrfx2_rx_msgs(fx2dev))
+        avail = fx2dev->rx_marks[fx2dev->rx_mark_tail & (RX_MARKS - 1)] - tail;
+    spin_unlock_irq(&fx2dev->rx_lock);
+
+    /*Copy out of rx_ring without rx_lock. rx_mutex keeps other readers
+      away and the callback only writes past rx_head*/
+    avail = min(count, avail);
+    while (bytes_read < avail) {
+        off   = (tail + bytes_read) & (fx2dev->rx_ring_size - 1);
+        chunk = min(avail - bytes_read, fx2dev->rx_ring_size - off);
+        copied = copy_to_iter(fx2dev->rx_ring + off, chunk, to);
+        bytes_read += copied;
+        if (copied < chunk) {
+            if (!bytes_read)
+                retval = -EFAULT;
+            break;
+        }
+    }
+
+    /*Give the space back, drop the message ends read past, pull in parked
+      buffers and resubmit them*/
+    spin_lock_irq(&fx2dev->rx_lock);
+    fx2dev->rx_tail += bytes_read;
+    while (osrfx2_rx_msgs(fx2dev) &&
+           fx2dev->rx_marks[fx2dev->rx_mark_tail & (RX_MARKS - 1)] == fx2dev->rx_tail)
+        fx2dev->rx_mark_tail++;
+    if (bytes_read)
+        fx2dev->rx_pull = 0;
+    osrfx2_rx_unpark(fx2dev);
+    spin_unlock_irq(&fx2dev->rx_lock);
+    osrfx2_rx_start(fx2dev);
+
+    if (bytes_read) {
+        /*Decrement the pending_data counter by the byte count received*/
+        atomic_sub(bytes_read, &fx2dev->pending_data);
+        retval = bytes_read;
+    }
+
+exit:
+    mutex_unlock(&fx2dev->rx_mutex);
+    return retval;
+}
+
+/*Read from /dev/osrfx2_0. Reads are always synchronous: an async read
+  never returns -EIOCBQUEUED, it is served from read-ahead data or waits
+  for it like read(), so a libaio read blocks inside io_submit. With
+  IOCB_NOWAIT an empty ring returns -EAGAIN so io_uring waits for POLLIN
+  instead of tying up a worker thread. A suspended device is woken first*/
+static ssize_t osrfx2_read_iter(struct kiocb * iocb, struct iov_iter * to) {
+    struct file *file = iocb->ki_filp;
+    struct osrfx2_file *client = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = client->fx2dev;
+    ssize_t retval;
+    int nonblock;
+
+    if (!iov_iter_count(to)) return 0;
+
+    nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+    if (client->event_mode)
+        return osrfx2_read_events(client, iocb, to, nonblock);
+
+    retval = osrfx2_pm_get(fx2dev, iocb->ki_flags & IOCB_NOWAIT);
+    if (retval) return retval;
+
+    retval = osrfx2_read_bulk(fx2dev, iocb, to, nonblock);
+
+    osrfx2_pm_put(fx2dev);
+    return retval;
+}
+
+static void read_bulk_callback(struct urb * urb) {
+    struct osrfx2_rx *rx = urb->context;
+    struct osrfx2 *fx2dev = rx->fx2dev;
+    unsigned long flags;
+    int unlinked;
+    int wake;
+
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, urb->status);
+    osrfx2_stat_complete(fx2dev, STAT_EP_BULK_IN, urb->status, urb->actual_length);
+    usb_mark_last_busy(fx2dev->udev);
+
+    spin_lock_irqsave(&fx2dev->rx_lock, flags);
+
+    /*An unlinked urb may already hold data, which is queued like any
+      other. Only a complete transfer can end a message or go out again*/
+    unlinked = urb->status == -ENOENT || urb->status == -ECONNRESET;
+
+    if (urb->status && !(unlinked && urb->actual_length)) {
+        /*Filter sync and async unlink events as non-errors*/
+        if (!(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN)) {
+            dev_err(&urb->dev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+            fx2dev->rx_error = urb->status;
+        }
+        list_add_tail(&rx->list, &fx2dev->rx_idle);
+    }
+    else if (urb->actual_length || fx2dev->rx_msg) {
+        /*A transfer cut short by a short packet or ZLP ends a message*/
+        rx->length = urb->actual_length;
+        rx->offset = 0;
+        rx->end    = fx2dev->rx_msg && !urb->status &&
+                     urb->actual_length < urb->transfer_buffer_length;
+        if (list_empty(&fx2dev->rx_done) && osrfx2_rx_fits(fx2dev, rx)) {
+            /*Data is in rx_ring, so the buffer can go straight back out*/
+            osrfx2_rx_take(fx2dev, rx);
+            if (urb->status || !osrfx2_rx_wanted(fx2dev) || osrfx2_rx_submit(fx2dev, rx))
+                list_add_tail(&rx->list, &fx2dev->rx_idle);
+        }
+        else
+            /*No room, park it until the reader catches up*/
+            list_add_tail(&rx->list, &fx2dev->rx_done);
+    }
+    else if (osrfx2_rx_wanted(fx2dev)) {
+        /*Zero length packet, nothing for the reader so go again*/
+        usb_anchor_urb(urb, &fx2dev->rx_anchor);
+        trace_osrfx2_submit(urb, urb->pipe, urb->transfer_buffer_length, 0);
+        if (usb_submit_urb(urb, GFP_ATOMIC)) {
+            usb_unanchor_urb(urb);
+            list_add_tail(&rx->list, &fx2dev->rx_idle);
+        }
+        else
+            osrfx2_stat_submit(fx2dev, STAT_EP_BULK_IN, urb->transfer_buffer_length);
+    }
+    else
+        list_add_tail(&rx->list, &fx2dev->rx_idle);
+
+    /*Small completions accumulate until they reach the waiting reader's
+      threshold, so a batching reader wakes once*/
+    wake = osrfx2_rx_ready_locked(fx2dev, min(fx2dev->rx_want, fx2dev->rx_lowat));
+
+    spin_unlock_irqrestore(&fx2dev->rx_lock, flags);
+
+    if (wake)
+        wake_up_interruptible(&fx2dev->rx_wait);
+}
+
+/*Allocate the bulk out pool. The limit semaphore counts the free entries*/
+static int osrfx2_tx_alloc(struct osrfx2 * fx2dev) {
+    struct osrfx2_tx *tx;
+    int pipe, i;
+
+    fx2dev->tx = kcalloc(fx2dev->tx_count, sizeof(*fx2dev->tx), GFP_KERNEL);
+    if (!fx2dev->tx)
+        return -ENOMEM;
+
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+
+    for (i = 0; i < fx2dev->tx_count; i++) {
+        tx = &fx2dev->tx[i];
+        tx->fx2dev = fx2dev;
+
+        tx->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!tx->urb)
+            return -ENOMEM;
+
+        tx->buffer = usb_alloc_coherent(fx2dev->udev, fx2dev->tx_size,
+                                        GFP_KERNEL, &tx->urb->transfer_dma);
+        if (!tx->buffer)
+            return -ENOMEM;
+
+        usb_fill_bulk_urb(tx->urb, fx2dev->udev, pipe, tx->buffer,
+                          fx2dev->tx_size, write_bulk_callback, tx);
+        tx->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+        list_add_tail(&tx->list, &fx2dev->tx_free);
+    }
+
+    sema_init(&fx2dev->limit_sem, fx2dev->tx_count);
+
+    return 0;
+}
+
+/*Free the bulk out pool. Nothing may be in flight*/
+static void osrfx2_tx_free(struct osrfx2 * fx2dev) {
+    struct osrfx2_tx *tx;
+    int i;
+
+    if (!fx2dev->tx)
+        return;
+
+    for (i = 0; i < fx2dev->tx_count; i++) {
+        tx = &fx2dev->tx[i];
+        if (!tx->urb)
+            break;
+        if (tx->buffer)
+            usb_free_coherent(fx2dev->udev, fx2dev->tx_size,
+                              tx->buffer, tx->urb->transfer_dma);
+        usb_free_urb(tx->urb);
+    }
+
+    kfree(fx2dev->tx);
+    fx2dev->tx = NULL;
+}
+
+/*Take a free pool entry. Caller must hold a limit_sem slot*/
+static struct osrfx2_tx *osrfx2_tx_get(struct osrfx2 * fx2dev) {
+    struct osrfx2_tx *tx;
+
+    spin_lock_irq(&fx2dev->tx_lock);
+    tx = list_first_entry(&fx2dev->tx_free, struct osrfx2_tx, list);
+    list_del(&tx->list);
+    spin_unlock_irq(&fx2dev->tx_lock);
+
+    return tx;
+}
+
+/*Return a pool entry and its limit_sem slot*/
+static void osrfx2_tx_put(struct osrfx2_tx * tx) {
+    struct osrfx2 *fx2dev = tx->fx2dev;
+    unsigned long flags;
+
+    spin_lock_irqsave(&fx2dev->tx_lock, flags);
+    list_add_tail(&tx->list, &fx2dev->tx_free);
+    spin_unlock_irqrestore(&fx2dev->tx_lock, flags);
+
+    up(&fx2dev->limit_sem);
+    wake_up_interruptible(&fx2dev->tx_wait);
+}
+
+/*Send a large write as one scatter-gather request built from single pages,
+  so no physically contiguous buffer is needed. Blocks until it completes*/
+static ssize_t osrfx2_write_sg(struct osrfx2 * fx2dev, struct iov_iter * from, size_t count) {
+    struct usb_sg_request io;
+    struct sg_table table;
+    struct scatterlist *sg;
+    struct page *page;
+    size_t chunk, offset = 0;
+    int nents, pipe, i;
+    ssize_t retval;
+
+    nents = DIV_ROUND_UP(count, PAGE_SIZE);
+    retval = sg_alloc_table(&table, nents, GFP_KERNEL);
+    if (retval)
+        return retval;
+
+    /*Copy the data into freshly allocated pages*/
+    for_each_sg(table.sgl, sg, nents, i) {
+        chunk = min_t(size_t, count - offset, PAGE_SIZE);
+
+        page = alloc_page(GFP_KERNEL);
+        if (!page) {
+            retval = -ENOMEM;
+            goto exit;
+        }
+        sg_set_page(sg, page, chunk, 0);
+
+        if (copy_page_from_iter(page, 0, chunk, from) != chunk) {
+            retval = -EFAULT;
+            goto exit;
+        }
+        offset += chunk;
+    }
+
+    /*Prevent the device from being disconnected while submitting*/
+    mutex_lock(&fx2dev->tx_mutex);
+    if (!fx2dev->interface) { /*Disconnect() was called*/
+        mutex_unlock(&fx2dev->tx_mutex);
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    /*Published under tx_mutex so disconnect either sees it or stops us above*/
+    pipe = usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr);
+    retval = usb_sg_init(&io, fx2dev->udev, pipe, 0, table.sgl, nents, count, GFP_KERNEL);
+    if (retval == 0) {
+        spin_lock_irq(&fx2dev->tx_lock);
+        fx2dev->tx_sg = &io;
+        spin_unlock_irq(&fx2dev->tx_lock);
+    }
+    mutex_unlock(&fx2dev->tx_mutex);
+    if (retval)
+        goto exit;
+
+    osrfx2_stat_submit(fx2dev, STAT_EP_BULK_OUT, count);
+    trace_osrfx2_submit(&io, pipe, count, 0);
+    usb_sg_wait(&io);
+
+    spin_lock_irq(&fx2dev->tx_lock);
+    fx2dev->tx_sg = NULL;
+    spin_unlock_irq(&fx2dev->tx_lock);
+    trace_osrfx2_complete(&io, pipe, io.bytes, io.status);
+    osrfx2_stat_complete(fx2dev, STAT_EP_BULK_OUT, io.status, io.bytes);
+
+    if (io.status && !(io.status == -ENOENT || io.status == -ECONNRESET || io.status == -ESHUTDOWN))
+        dev_err(&fx2dev->udev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, io.status);
+
+    /*Increment the pending_data counter by the byte count sent*/
+    atomic_add(io.bytes, &fx2dev->pending_data);
+    retval = io.bytes ? io.bytes : io.status;
+
+exit:
+    for_each_sg(table.sgl, sg, nents, i) {
+        if (sg_page(sg))
+            __free_page(sg_page(sg));
+    }
+    sg_free_table(&table);
+
+    return retval;
+}
+
+/*Bytes sent by an async write, or the first error if none were*/
+static long osrfx2_aio_result(struct osrfx2_aio * aio) {
+    long result = atomic_long_read(&aio->bytes);
+
+    return result ? result : aio->status;
+}
+
+/*Finish an async write from the completion handler*/
+static void osrfx2_aio_complete(struct osrfx2_aio * aio) {
+    long result = osrfx2_aio_result(aio);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+    aio->iocb->ki_complete(aio->iocb, result);
+#else
+    aio->iocb->ki_complete(aio->iocb, result, 0);
+#endif
+    kfree(aio);
+}
+
+/*Write to bulk endpoint. Async writes return -EIOCBQUEUED once queued
+  and are completed from write_bulk_callback*/
+static ssize_t osrfx2_write_pool(struct kiocb * iocb, struct iov_iter * from) {
+    struct file *file = iocb->ki_filp;
+    struct osrfx2 *fx2dev;
+    struct osrfx2_tx *tx;
+    struct osrfx2_aio *aio = NULL;
+    size_t count = iov_iter_count(from);
+    size_t written = 0;
+    size_t chunk;
+    int nonblock, msg_mode;
+    int retval = 0;
+
+    fx2dev   = ((struct osrfx2_file *)file->private_data)->fx2dev;
+    msg_mode = ((struct osrfx2_file *)file->private_data)->msg_mode;
+
+    if (!count) return count;
+
+    nonblock = (file->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+
+    if (!is_sync_kiocb(iocb)) {
+        aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+        if (!aio) return -ENOMEM;
+        aio->iocb = iocb;
+        atomic_set(&aio->pending, 1);
+        atomic_long_set(&aio->bytes, 0);
+    }
+    /*Large blocking writes go out as scatter-gather requests, which
+      can't end in a ZLP*/
+    else if (sg_write_min > 0 && count >= sg_write_min && !nonblock && !msg_mode) {
+        while (written < count) {
+            chunk  = min_t(size_t, count - written, SG_WRITE_MAX);
+            retval = osrfx2_write_sg(fx2dev, from, chunk);
+            if (retval <= 0)
+                break;
+            written += retval;
+
+            if (retval < chunk || signal_pending(current))
+                break;
+        }
+
+        return written ? written : retval;
+    }
+
+    /*Split the write across pool buffers*/
+    while (written < count) {
+        /*Wait for a free pool entry. Data already queued is reported
+          as a short write if we have to give up. An async write only
+          waits for its first entry*/
+        if (!nonblock && !(aio && written)) {
+            if (down_interruptible(&fx2dev->limit_sem)) {
+                retval = -ERESTARTSYS;
+                break;
+            }
+        }
+        else {
+            if (down_trylock(&fx2dev->limit_sem)) {
+                retval = -EAGAIN;
+                break;
+            }
+        }
+
+        tx = osrfx2_tx_get(fx2dev);
+        chunk = min(count - written, fx2dev->tx_size);
+
+        /*Copy the data to the buffer*/
+        if (copy_from_iter(tx->buffer, chunk, from) != chunk) {
+            osrfx2_tx_put(tx);
+            retval = -EFAULT;
+            break;
+        }
+        tx->urb->transfer_buffer_length = chunk;
+
+        /*In message mode the last chunk ends on a short packet, or on a
+          ZLP if it is a multiple of the packet size*/
+        if (msg_mode && written + chunk == count)
+            tx->urb->transfer_flags |= URB_ZERO_PACKET;
+        else
+            tx->urb->transfer_flags &= ~URB_ZERO_PACKET;
+
+        /*No lock against disconnect here. It poisons tx_anchor after
+          clearing interface, so a submit that races with it fails*/
+        if (!READ_ONCE(fx2dev->interface)) { /*Disconnect() was called*/
+            osrfx2_tx_put(tx);
+            retval = -ENODEV;
+            break;
+        }
+
+        /*Send the data out the bulk port*/
+        if (aio) {
+            tx->aio = aio;
+            atomic_inc(&aio->pending);
+        }
+        osrfx2_stat_depth(fx2dev, atomic_inc_return(&fx2dev->tx_in_flight));
+        tx->submit_ns = ktime_get_ns();
+        usb_anchor_urb(tx->urb, &fx2dev->tx_anchor);
+        trace_osrfx2_submit(tx->urb, tx->urb->pipe, tx->urb->transfer_buffer_length, 0);
+        retval = usb_submit_urb(tx->urb, GFP_KERNEL);
+        if (retval == 0)
+            osrfx2_stat_submit(fx2dev, STAT_EP_BULK_OUT, chunk);
+        else
+            usb_unanchor_urb(tx->urb);
+        if (retval == -EPERM) /*Poisoned by disconnect*/
+            retval = -ENODEV;
+
+        if (retval) {
+            atomic_dec(&fx2dev->tx_in_flight);
+            if (aio) {
+                tx->aio = NULL;
+                atomic_dec(&aio->pending);
+            }
+            dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+            osrfx2_tx_put(tx);
+            break;
+        }
+
+        /*Increment the pending_data counter by the byte count sent*/
+        atomic_add(chunk, &fx2dev->pending_data);
+        written += chunk;
+    }
+
+    if (!aio)
+        return written ? written : retval;
+
+    /*Nothing queued, or everything already done: complete inline*/
+    if (!written)
+        aio->status = retval;
+    if (atomic_dec_and_test(&aio->pending)) {
+        retval = osrfx2_aio_result(aio);
+        kfree(aio);
+        return retval;
+    }
+
+    return -EIOCBQUEUED;
+}
+
+/*Write to /dev/osrfx2_0, waking a suspended device first. URBs still in
+  flight on return hold off autosuspend through osrfx2_pm_busy*/
+static ssize_t osrfx2_write_iter(struct kiocb * iocb, struct iov_iter * from) {
+    struct osrfx2 *fx2dev = ((struct osrfx2_file *)iocb->ki_filp->private_data)->fx2dev;
+    ssize_t retval;
+
+    if (!iov_iter_count(from)) return 0;
+
+    retval = osrfx2_pm_get(fx2dev, iocb->ki_flags & IOCB_NOWAIT);
+    if (retval) return retval;
+
+    retval = osrfx2_write_pool(iocb, from);
+
+    osrfx2_pm_put(fx2dev);
+    return retval;
+}
+
+static void write_bulk_callback(struct urb * urb) {
+    struct osrfx2_tx *tx = urb->context;
+    struct osrfx2 *fx2dev = tx->fx2dev;
+    struct osrfx2_aio *aio = tx->aio;
+
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, urb->status);
+    osrfx2_stat_complete(fx2dev, STAT_EP_BULK_OUT, urb->status, urb->actual_length);
+    osrfx2_stat_latency(fx2dev->stats.out_lat, tx->submit_ns);
+    usb_mark_last_busy(fx2dev->udev);
+ 
+    /*  Filter sync and async unlink events as non-errors*/
+    if(urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+        dev_err(&fx2dev->udev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+
+    /*Keep the first failure for flush and fsync*/
+    if (urb->status)
+        cmpxchg(&fx2dev->tx_error, 0, urb->status);
+
+    /*Account for the async write this entry belongs to*/
+    if (aio) {
+        tx->aio = NULL;
+        if (urb->status)
+            cmpxchg(&aio->status, 0, urb->status);
+        else
+            atomic_long_add(urb->actual_length, &aio->bytes);
+        if (atomic_dec_and_test(&aio->pending))
+            osrfx2_aio_complete(aio);
+    }
+
+    /*Give the buffer back to the pool*/
+    atomic_dec(&fx2dev->tx_in_flight);
+    osrfx2_tx_put(tx);
+}
+
+/*Allocate the mmap ring on first use*/
+static int osrfx2_mmap_setup(struct osrfx2 * fx2dev) {
+    struct osrfx2_mbuf *m;
+    int retval = 0;
+    int count, i;
+
+    mutex_lock(&fx2dev->mmap_mutex);
+    if (fx2dev->mbuf)
+        goto exit;
+
+    count = max(mmap_bufs, 1);
+    fx2dev->mbuf_size = PAGE_ALIGN(max(mmap_buf_size, 1));
+    fx2dev->mbuf = kcalloc(2 * count, sizeof(*fx2dev->mbuf), GFP_KERNEL);
+    if (!fx2dev->mbuf) {
+        retval = -ENOMEM;
+        goto exit;
+    }
+    fx2dev->mbuf_count = count;
+
+    for (i = 0; i < 2 * count; i++) {
+        m = &fx2dev->mbuf[i];
+        m->fx2dev = fx2dev;
+        m->index  = i % count;
+        m->is_out = (i >= count);
+        m->state  = MBUF_IDLE;
+
+        m->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!m->urb) {
+            retval = -ENOMEM;
+            break;
+        }
+
+        /*Zeroed, the pages end up in user space*/
+        m->buffer = alloc_pages_exact(fx2dev->mbuf_size, GFP_KERNEL | __GFP_ZERO);
+        if (!m->buffer) {
+            retval = -ENOMEM;
+            break;
+        }
+
+        usb_fill_bulk_urb(m->urb, fx2dev->udev,
+                          m->is_out ? usb_sndbulkpipe(fx2dev->udev, fx2dev->bulk_out_endpointAddr)
+                                    : usb_rcvbulkpipe(fx2dev->udev, fx2dev->bulk_in_endpointAddr),
+                          m->buffer, fx2dev->mbuf_size, mmap_bulk_callback, m);
+    }
+
+    if (retval)
+        osrfx2_mmap_free(fx2dev);
+
+exit:
+    mutex_unlock(&fx2dev->mmap_mutex);
+    return retval;
+}
+
+/*Free the mmap ring. Nothing may be in flight or mapped*/
+static void osrfx2_mmap_free(struct osrfx2 * fx2dev) {
+    struct osrfx2_mbuf *m;
+    int i;
+
+    if (!fx2dev->mbuf)
+        return;
+
+    for (i = 0; i < 2 * fx2dev->mbuf_count; i++) {
+        m = &fx2dev->mbuf[i];
+        if (m->buffer)
+            free_pages_exact(m->buffer, fx2dev->mbuf_size);
+        usb_free_urb(m->urb);
+    }
+
+    kfree(fx2dev->mbuf);
+    fx2dev->mbuf = NULL;
+    fx2dev->mbuf_count = 0;
+}
+
+/*Cancel one direction of the mmap ring and hand every buffer back to user space*/
+static void osrfx2_mmap_reset(struct osrfx2 * fx2dev, int is_out) {
+    struct list_head *done = is_out ? &fx2dev->mmap_out_done : &fx2dev->mmap_in_done;
+    struct osrfx2_mbuf *m;
+    int i;
+
+    if (!fx2dev->mbuf)
+        return;
+
+    for (i = 0; i < fx2dev->mbuf_count; i++)
+        usb_kill_urb(fx2dev->mbuf[(is_out ? fx2dev->mbuf_count : 0) + i].urb);
+
+    spin_lock_irq(&fx2dev->mmap_lock);
+    while (!list_empty(done)) {
+        m = list_first_entry(done, struct osrfx2_mbuf, list);
+        list_del(&m->list);
+        m->state = MBUF_IDLE;
+    }
+    spin_unlock_irq(&fx2dev->mmap_lock);
+}
+
+/*True while bulk in mmap buffers are queued or not yet reaped*/
+static int osrfx2_mmap_in_busy(struct osrfx2 * fx2dev) {
+    int busy;
+
+    spin_lock_irq(&fx2dev->mmap_lock);
+    busy = fx2dev->mmap_queued[0] || !list_empty(&fx2dev->mmap_in_done);
+    spin_unlock_irq(&fx2dev->mmap_lock);
+
+    return busy;
+}
+
+/*Map the ring into user space*/
+static int osrfx2_mmap(struct file * file, struct vm_area_struct * vma) {
+    struct osrfx2 *fx2dev = ((struct osrfx2_file *)file->private_data)->fx2dev;
+    unsigned long size   = vma->vm_end - vma->vm_start;
+    unsigned long addr   = vma->vm_start;
+    unsigned long offset, total, within, chunk;
+    struct osrfx2_mbuf *m;
+    int retval;
+
+    retval = osrfx2_mmap_setup(fx2dev);
+    if (retval) return retval;
+
+    total = 2 * fx2dev->mbuf_count * fx2dev->mbuf_size;
+    if (vma->vm_pgoff >= (total >> PAGE_SHIFT))
+        return -EINVAL;
+    offset = vma->vm_pgoff << PAGE_SHIFT;
+    if (size > total - offset)
+        return -EINVAL;
+
+    /*Each buffer is physically contiguous, the ring as a whole is not*/
+    while (size) {
+        m      = &fx2dev->mbuf[offset / fx2dev->mbuf_size];
+        within = offset % fx2dev->mbuf_size;
+        chunk  = min_t(unsigned long, size, fx2dev->mbuf_size - within);
+
+        retval = remap_pfn_range(vma, addr, virt_to_phys(m->buffer + within) >> PAGE_SHIFT,
+                                 chunk, vma->vm_page_prot);
+        if (retval) return retval;
+
+        addr   += chunk;
+        offset += chunk;
+        size   -= chunk;
+    }
+
+    return 0;
+}
+
+/*Queue an mmap buffer on the bulk out or bulk in pipe*/
+static int osrfx2_mmap_submit(struct osrfx2 * fx2dev, struct file * file,
+                              struct osrfx2_mmap_buf * mb, int is_out) {
+    struct osrfx2_file *client = (struct osrfx2_file *)file->private_data;
+    struct osrfx2_mbuf *m;
+    struct mutex *pipe_mutex;
+    int retval;
+
+    if (!(is_out ? client->claimed_out : client->claimed_in))
+        return -EBADF;
+
+    retval = osrfx2_mmap_setup(fx2dev);
+    if (retval) return retval;
+
+    if (mb->index >= fx2dev->mbuf_count)
+        return -EINVAL;
+    if (is_out && (!mb->length || mb->length > fx2dev->mbuf_size))
+        return -EINVAL;
+
+    m = &fx2dev->mbuf[(is_out ? fx2dev->mbuf_count : 0) + mb->index];
+
+    /*Same lock as write() or read() for the direction*/
+    pipe_mutex = is_out ? &fx2dev->tx_mutex : &fx2dev->rx_mutex;
+    mutex_lock(pipe_mutex);
+    if (!fx2dev->interface) { /*Disconnect() was called*/
+        retval = -ENODEV;
+        goto exit;
+    }
+
+    /*read() and the mmap ring can't share the bulk in pipe*/
+    if (!is_out && fx2dev->rx_running) {
+        retval = -EBUSY;
+        goto exit;
+    }
+
+    spin_lock_irq(&fx2dev->mmap_lock);
+    if (m->state != MBUF_IDLE) {
+        spin_unlock_irq(&fx2dev->mmap_lock);
+        retval = -EBUSY;
+        goto exit;
+    }
+    m->state = MBUF_QUEUED;
+    fx2dev->mmap_queued[is_out]++;
+    spin_unlock_irq(&fx2dev->mmap_lock);
+
+    m->urb->transfer_buffer_length = is_out ? mb->length : fx2dev->mbuf_size;
+    usb_anchor_urb(m->urb, &fx2dev->mmap_anchor);
+
+    trace_osrfx2_submit(m->urb, m->urb->pipe, m->urb->transfer_buffer_length, 0);
+    retval = usb_submit_urb(m->urb, GFP_KERNEL);
+    if (retval) {
+        usb_unanchor_urb(m->urb);
+        dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+
+        spin_lock_irq(&fx2dev->mmap_lock);
+        m->state = MBUF_IDLE;
+        fx2dev->mmap_queued[is_out]--;
+        spin_unlock_irq(&fx2dev->mmap_lock);
+    }
+    else {
+        osrfx2_stat_submit(fx2dev, is_out ? STAT_EP_BULK_OUT : STAT_EP_BULK_IN,
+                           m->urb->transfer_buffer_length);
+
+        /*Increment the pending_data counter by the byte count sent*/
+        if (is_out)
+            atomic_add(mb->length, &fx2dev->pending_data);
+    }
+
+exit:
+    mutex_unlock(pipe_mutex);
+    return retval;
+}
+
+/*Take the oldest completed mmap buffer in one direction*/
+static int osrfx2_mmap_reap(struct osrfx2 * fx2dev, struct file * file,
+                            struct osrfx2_mmap_buf * mb, int is_out) {
+    struct osrfx2_file *client = (struct osrfx2_file *)file->private_data;
+    struct list_head *done = is_out ? &fx2dev->mmap_out_done : &fx2dev->mmap_in_done;
+    struct osrfx2_mbuf *m = NULL;
+    int retval;
+
+    if (!(is_out ? client->claimed_out : client->claimed_in))
+        return -EBADF;
+
+    if (!fx2dev->mbuf)
+        return -ENODATA;
+
+    while (!m) {
+        spin_lock_irq(&fx2dev->mmap_lock);
+        if (!list_empty(done)) {
+            m = list_first_entry(done, struct osrfx2_mbuf, list);
+            list_del(&m->list);
+            m->state = MBUF_IDLE;
+        }
+        else if (!fx2dev->mmap_queued[is_out]) {
+            spin_unlock_irq(&fx2dev->mmap_lock);
+            return -ENODATA; /*Nothing to wait for*/
+        }
+        spin_unlock_irq(&fx2dev->mmap_lock);
+
+        if (m)
+            break;
+
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+
+        retval = wait_event_interruptible(fx2dev->mmap_wait,
+                                          !list_empty_careful(done) || !fx2dev->interface);
+        if (retval) return retval;
+
+        if (!fx2dev->interface && list_empty_careful(done))
+            return -ENODEV;
+    }
+
+    mb->index    = m->index;
+    mb->length   = m->urb->actual_length;
+    mb->status   = m->urb->status;
+    mb->reserved = 0;
+
+    /*Decrement the pending_data counter by the byte count received*/
+    if (!is_out)
+        atomic_sub(mb->length, &fx2dev->pending_data);
+
+    return 0;
+}
+
+static void mmap_bulk_callback(struct urb * urb) {
+    struct osrfx2_mbuf *m = urb->context;
+    struct osrfx2 *fx2dev = m->fx2dev;
+    unsigned long flags;
+
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, urb->status);
+    osrfx2_stat_complete(fx2dev, m->is_out ? STAT_EP_BULK_OUT : STAT_EP_BULK_IN,
+                         urb->status, urb->actual_length);
+    usb_mark_last_busy(fx2dev->udev);
+
+    /*Filter sync and async unlink events as non-errors*/
+    if (urb->status && !(urb->status == -ENOENT || urb->status == -ECONNRESET || urb->status == -ESHUTDOWN))
+        dev_err(&urb->dev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+
+    spin_lock_irqsave(&fx2dev->mmap_lock, flags);
+    m->state = MBUF_DONE;
+    fx2dev->mmap_queued[m->is_out]--;
+    list_add_tail(&m->list, m->is_out ? &fx2dev->mmap_out_done : &fx2dev->mmap_in_done);
+    spin_unlock_irqrestore(&fx2dev->mmap_lock, flags);
+
+    wake_up_interruptible(&fx2dev->mmap_wait);
+
+    /*Out buffers count for flush and fsync like pool writes*/
+    if (m->is_out) {
+        if (urb->status)
+            cmpxchg(&fx2dev->tx_error, 0, urb->status);
+        wake_up_interruptible(&fx2dev->tx_wait);
+    }
+}
+
+static long osrfx2_do_ioctl(struct file * file, unsigned int cmd, unsigned long arg) {
+    struct osrfx2_file *client = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = client->fx2dev;
+    void __user *argp = (void __user *)arg;
+    struct osrfx2_mmap_info info;
+    struct osrfx2_mmap_buf mb;
+    struct osrfx2_display disp;
+    unsigned char value;
+    __u32 lowat, on;
+    __s32 ms;
+    int retval;
+
+    switch (cmd) {
+    case OSRFX2_IOC_MMAP_INFO:
+        retval = osrfx2_mmap_setup(fx2dev);
+        if (retval)
+            return retval;
+
+        memset(&info, 0, sizeof(info));
+        info.buf_size = fx2dev->mbuf_size;
+        info.nr_in    = fx2dev->mbuf_count;
+        info.nr_out   = fx2dev->mbuf_count;
+
+        if (copy_to_user(argp, &info, sizeof(info)))
+            return -EFAULT;
+        return 0;
+
+    case OSRFX2_IOC_SUBMIT_OUT:
+    case OSRFX2_IOC_SUBMIT_IN:
+        if (copy_from_user(&mb, argp, sizeof(mb)))
+            return -EFAULT;
+        return osrfx2_mmap_submit(fx2dev, file, &mb, cmd == OSRFX2_IOC_SUBMIT_OUT);
+
+    case OSRFX2_IOC_REAP_OUT:
+    case OSRFX2_IOC_REAP_IN:
+        retval = osrfx2_mmap_reap(fx2dev, file, &mb, cmd == OSRFX2_IOC_REAP_OUT);
+        if (retval)
+            return retval;
+        if (copy_to_user(argp, &mb, sizeof(mb)))
+            return -EFAULT;
+        return 0;
+
+    case OSRFX2_IOC_EVENT_MODE:
+        if (!(file->f_mode & FMODE_READ))
+            return -EBADF;
+
+        /*Event files don't use the bulk in pipe, let a reader have it*/
+        mutex_lock(&fx2dev->rx_mutex);
+        if (client->claimed_in) {
+            client->claimed_in = 0;
+            mutex_unlock(&fx2dev->rx_mutex);
+            osrfx2_rx_stop(fx2dev);
+            osrfx2_mmap_reset(fx2dev, 0);
+            atomic_inc( &fx2dev->bulk_read_available );
+        }
+        else
+            mutex_unlock(&fx2dev->rx_mutex);
+
+        /*Only changes from now on are queued for this file*/
+        spin_lock_irq(&fx2dev->event_lock);
+        if (!client->event_mode) {
+            client->event_mode = 1;
+            list_add_tail(&client->event_node, &fx2dev->event_files);
+        }
+        spin_unlock_irq(&fx2dev->event_lock);
+        return 0;
+
+    case OSRFX2_IOC_SET_RX_LOWAT:
+        if (!client->claimed_in)
+            return -EBADF;
+        if (get_user(lowat, (__u32 __user *)argp))
+            return -EFAULT;
+        if (!lowat || lowat > fx2dev->rx_ring_size)
+            return -EINVAL;
+
+        spin_lock_irq(&fx2dev->rx_lock);
+        fx2dev->rx_lowat = lowat;
+        fx2dev->rx_want  = lowat;
+        spin_unlock_irq(&fx2dev->rx_lock);
+
+        /*A lower mark may already be met*/
+        wake_up_interruptible(&fx2dev->rx_wait);
+        return 0;
+
+    case OSRFX2_IOC_SET_MSG_MODE:
+        if (!client->claimed_in && !client->claimed_out)
+            return -EBADF;
+        if (get_user(on, (__u32 __user *)argp))
+            return -EFAULT;
+        client->msg_mode = !!on;
+
+        /*Data already buffered has no message ends, drop it*/
+        if (client->claimed_in) {
+            mutex_lock(&fx2dev->rx_mutex);
+            if (fx2dev->interface && fx2dev->rx_msg != !!on)
+                osrfx2_rx_reset(fx2dev, !!on);
+            mutex_unlock(&fx2dev->rx_mutex);
+        }
+        return 0;
+
+    case OSRFX2_IOC_SET_PREFETCH:
+        if (!client->claimed_in)
+            return -EBADF;
+        if (get_user(on, (__u32 __user *)argp))
+            return -EFAULT;
+
+        spin_lock_irq(&fx2dev->rx_lock);
+        fx2dev->rx_prefetch = !!on;
+        spin_unlock_irq(&fx2dev->rx_lock);
+
+        /*Turning it on fills the pipe right away*/
+        mutex_lock(&fx2dev->rx_mutex);
+        if (on && fx2dev->rx_running)
+            osrfx2_rx_start(fx2dev);
+        mutex_unlock(&fx2dev->rx_mutex);
+        return 0;
+
+    case OSRFX2_IOC_SET_READ_TIMEOUT:
+        if (get_user(ms, (__s32 __user *)argp))
+            return -EFAULT;
+        if (ms < 0 && ms != OSRFX2_READ_TIMEOUT_ADAPTIVE)
+            return -EINVAL;
+        client->read_timeout = ms;
+        return 0;
+
+    case OSRFX2_IOC_GET_READ_TIMEOUT:
+        mutex_lock(&fx2dev->rx_mutex);
+        ms = jiffies_to_msecs(osrfx2_read_timeout(fx2dev, client));
+        mutex_unlock(&fx2dev->rx_mutex);
+        return put_user(ms, (__s32 __user *)argp);
+
+    case OSRFX2_IOC_GET_7SEG:
+        retval = osrfx2_reg_read(fx2dev, &fx2dev->segments, 0, &value);
+        if (retval)
+            return retval;
+        return put_user(seg_dec[value], (__u8 __user *)argp);
+
+    case OSRFX2_IOC_SET_7SEG:
+        if (get_user(value, (__u8 __user *)argp))
+            return -EFAULT;
+        return osrfx2_reg_write(fx2dev, &fx2dev->segments, seg_enc[value]);
+
+    case OSRFX2_IOC_GET_BARGRAPH:
+        retval = osrfx2_reg_read(fx2dev, &fx2dev->leds, 0, &value);
+        if (retval)
+            return retval;
+        return put_user(leds_dec[value], (__u8 __user *)argp);
+
+    case OSRFX2_IOC_SET_BARGRAPH:
+        if (get_user(value, (__u8 __user *)argp))
+            return -EFAULT;
+        return osrfx2_reg_write(fx2dev, &fx2dev->leds, leds_enc[value]);
+
+    case OSRFX2_IOC_GET_SWITCHES:
+        /*Kept current by the interrupt endpoint*/
+        return put_user(osrfx2_switches(fx2dev, NULL), (__u8 __user *)argp);
+
+    case OSRFX2_IOC_IS_HIGH_SPEED:
+        mutex_lock(&fx2dev->ctrl_mutex);
+        retval = READ_ONCE(fx2dev->suspended) ? -EAGAIN : osrfx2_ctrl_in(fx2dev, IS_HIGH_SPEED, &value);
+        mutex_unlock(&fx2dev->ctrl_mutex);
+        if (retval)
+            return retval;
+        return put_user(value, (__u8 __user *)argp);
+
+    case OSRFX2_IOC_SET_DISPLAY:
+        if (copy_from_user(&disp, argp, sizeof(disp)))
+            return -EFAULT;
+        if (disp.flags & ~(OSRFX2_DISPLAY_BARGRAPH | OSRFX2_DISPLAY_7SEG | OSRFX2_DISPLAY_SYNC) ||
+            disp.reserved)
+            return -EINVAL;
+
+        if (disp.flags & OSRFX2_DISPLAY_BARGRAPH)
+            osrfx2_reg_write(fx2dev, &fx2dev->leds, leds_enc[disp.bargraph]);
+        if (disp.flags & OSRFX2_DISPLAY_7SEG)
+            osrfx2_reg_write(fx2dev, &fx2dev->segments, seg_enc[disp.segments]);
+        if (disp.flags & OSRFX2_DISPLAY_SYNC)
+            return osrfx2_ctrl_sync(fx2dev);
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/*ioctl interface, see osrfx2_ioctl.h. Commands that reach the device
+  wake it first*/
+static long osrfx2_ioctl(struct file * file, unsigned int cmd, unsigned long arg) {
+    struct osrfx2 *fx2dev = ((struct osrfx2_file *)file->private_data)->fx2dev;
+    long retval;
+
+    switch (cmd) {
+    case OSRFX2_IOC_SUBMIT_OUT:
+    case OSRFX2_IOC_SUBMIT_IN:
+    case OSRFX2_IOC_GET_7SEG:
+    case OSRFX2_IOC_SET_7SEG:
+    case OSRFX2_IOC_GET_BARGRAPH:
+    case OSRFX2_IOC_SET_BARGRAPH:
+    case OSRFX2_IOC_IS_HIGH_SPEED:
+    case OSRFX2_IOC_SET_DISPLAY:
+        break;
+    default:
+        return osrfx2_do_ioctl(file, cmd, arg);
+    }
+
+    retval = osrfx2_pm_get(fx2dev, 0);
+    if (retval)
+        return retval;
+
+    retval = osrfx2_do_ioctl(file, cmd, arg);
+
+    osrfx2_pm_put(fx2dev);
+    return retval;
+}
+
+/*Submit read-ahead for a poller once rx_running or rx_pull is set. A
+  board still resuming is left to osrfx2_resume, which starts the ring
+  when it sees rx_running*/
+static void osrfx2_poll_rx_start(struct osrfx2 * fx2dev) {
+    smp_mb(); /*Flag store before the suspended load, pairs with osrfx2_resume*/
+    if (!READ_ONCE(fx2dev->suspended))
+        osrfx2_rx_start(fx2dev);
+}
+
+/*Report read-ahead data as POLLIN, free pool entries as POLLOUT and
+  switch changes since the last poll on this file as POLLPRI*/
+static unsigned int osrfx2_poll(struct file * file, poll_table * wait) {
+    struct osrfx2_file *client = (struct osrfx2_file *)file->private_data;
+    struct osrfx2 *fx2dev = client->fx2dev;
+    unsigned int mask = 0;
+    unsigned int seq;
+    int pull = 0;
+    int awake;
+
+    poll_wait(file, &fx2dev->FieldEventQueue, wait);
+    if (client->claimed_in)
+        poll_wait(file, &fx2dev->rx_wait, wait);
+    if (file->f_mode & FMODE_WRITE)
+        poll_wait(file, &fx2dev->tx_wait, wait);
+
+    if (!fx2dev->interface) /*Disconnect() was called*/
+        return POLLERR | POLLHUP;
+
+    if (client->event_mode) {
+        if (!kfifo_is_empty(&client->events))
+            mask |= POLLIN | POLLRDNORM;
+    }
+    else if (client->claimed_in) {
+        /*Polling for input starts read-ahead like a read would. poll
+          can't wait for a resume, so a suspended board is only woken*/
+        awake = osrfx2_pm_get(fx2dev, 1) == 0;
+
+        mutex_lock(&fx2dev->rx_mutex);
+        if (fx2dev->interface && !fx2dev->rx_running && !osrfx2_mmap_in_busy(fx2dev)) {
+            spin_lock_irq(&fx2dev->rx_lock);
+            fx2dev->rx_running = 1;
+            spin_unlock_irq(&fx2dev->rx_lock);
+            osrfx2_poll_rx_start(fx2dev);
+        }
+        mutex_unlock(&fx2dev->rx_mutex);
+
+        spin_lock_irq(&fx2dev->rx_lock);
+        if ((fx2dev->rx_msg ? osrfx2_rx_msgs(fx2dev) != 0 : osrfx2_rx_used(fx2dev) >= fx2dev->rx_lowat) ||
+            !list_empty(&fx2dev->rx_done) || fx2dev->rx_error)
+            mask |= POLLIN | POLLRDNORM;
+        else if (!fx2dev->rx_prefetch && fx2dev->rx_running && !fx2dev->rx_pull) {
+            /*Without prefetch a poller asks for data like a reader*/
+            fx2dev->rx_pull = 1;
+            pull = 1;
+        }
+        spin_unlock_irq(&fx2dev->rx_lock);
+        if (pull)
+            osrfx2_poll_rx_start(fx2dev);
+
+        if (awake)
+            osrfx2_pm_put(fx2dev);
+    }
+
+    if (file->f_mode & FMODE_WRITE) {
+        spin_lock_irq(&fx2dev->tx_lock);
+        if (!list_empty(&fx2dev->tx_free))
+            mask |= POLLOUT | POLLWRNORM;
+        spin_unlock_irq(&fx2dev->tx_lock);
+    }
+
+    osrfx2_switches(fx2dev, &seq);
+    if (client->switch_seq != seq) {
+        client->switch_seq = seq;
+        mask |= POLLPRI;
+    }
+
+    return mask;
+}
+
+/*Cached switch state and, if seq is set, the change count it goes with*/
+static unsigned char osrfx2_switches(struct osrfx2 * fx2dev, unsigned int * seq) {
+    unsigned char switches;
+    unsigned int start;
+
+    do {
+        start    = read_seqbegin(&fx2dev->switch_lock);
+        switches = fx2dev->switches;
+        if (seq)
+            *seq = fx2dev->switch_seq;
+    } while (read_seqretry(&fx2dev->switch_lock, start));
+
+    return switches;
+}
+
+/*Allocate the interrupt URBs. All start out idle*/
+static int osrfx2_int_alloc(struct osrfx2 * fx2dev) {
+    struct osrfx2_int *in;
+    int pipe, i;
+
+    fx2dev->int_count = clamp(int_urbs, 1, INT_URBS_MAX);
+    pipe = usb_rcvintpipe(fx2dev->udev, fx2dev->int_in_endpointAddr);
+
+    for (i = 0; i < fx2dev->int_count; i++) {
+        in = &fx2dev->int_in[i];
+        in->fx2dev = fx2dev;
+        in->index  = i;
+
+        in->urb = usb_alloc_urb(0, GFP_KERNEL);
+        if (!in->urb)
+            return -ENOMEM;
+
+        in->buffer = kmalloc(fx2dev->int_in_size, GFP_KERNEL);
+        if (!in->buffer)
+            return -ENOMEM;
+
+        usb_fill_int_urb(in->urb, fx2dev->udev, pipe, in->buffer,
+                         fx2dev->int_in_size, interrupt_handler, in,
+                         fx2dev->int_in_endpointInterval);
+
+        fx2dev->int_idle |= BIT(i);
+    }
+
+    return 0;
+}
+
+static void osrfx2_int_free(struct osrfx2 * fx2dev) {
+    int i;
+
+    for (i = 0; i < fx2dev->int_count; i++) {
+        usb_free_urb(fx2dev->int_in[i].urb);
+        kfree(fx2dev->int_in[i].buffer);
+    }
+}
+
+/*Submit one interrupt URB. Caller holds int_lock*/
+static int osrfx2_int_submit(struct osrfx2 * fx2dev, struct osrfx2_int * in, gfp_t mem_flags) {
+    int retval;
+
+    usb_anchor_urb(in->urb, &fx2dev->int_anchor);
+    trace_osrfx2_submit(in->urb, in->urb->pipe, in->urb->transfer_buffer_length, 0);
+    retval = usb_submit_urb(in->urb, mem_flags);
+    if (retval) {
+        usb_unanchor_urb(in->urb);
+        return retval;
+    }
+    osrfx2_stat_submit(fx2dev, STAT_EP_INT_IN, fx2dev->int_in_size);
+
+    return 0;
+}
+
+/*Mark an interrupt URB idle and, unless the device is going away,
+  retry it after the current backoff. Caller holds int_lock*/
+static void osrfx2_int_park(struct osrfx2 * fx2dev, struct osrfx2_int * in, int error) {
+    fx2dev->int_idle |= BIT(in->index);
+
+    if (!fx2dev->int_running || error == -ENODEV || error == -ESHUTDOWN || error == -EPERM)
+        return;
+
+    if (error == -EPIPE)
+        fx2dev->int_halted = 1;
+
+    fx2dev->int_backoff = fx2dev->int_backoff ?
+                          min(fx2dev->int_backoff * 2, (unsigned int)INT_BACKOFF_MAX) : INT_BACKOFF_MIN;
+    schedule_delayed_work(&fx2dev->int_retry, msecs_to_jiffies(fx2dev->int_backoff));
+}
+
+/*Submit every idle interrupt URB. Returns the first submit error, those
+  URBs are retried with backoff*/
+static int osrfx2_int_resubmit(struct osrfx2 * fx2dev) {
+    struct osrfx2_int *in;
+    int retval = 0;
+    int i;
+
+    spin_lock_irq(&fx2dev->int_lock);
+    for (i = 0; i < fx2dev->int_count && fx2dev->int_running; i++) {
+        in = &fx2dev->int_in[i];
+        if (!(fx2dev->int_idle & BIT(i)))
+            continue;
+
+        fx2dev->int_idle &= ~BIT(i);
+        retval = osrfx2_int_submit(fx2dev, in, GFP_ATOMIC);
+        if (retval) {
+            osrfx2_int_park(fx2dev, in, retval);
+            break;
+        }
+    }
+    spin_unlock_irq(&fx2dev->int_lock);
+
+    return retval;
+}
+
+static int osrfx2_int_start(struct osrfx2 * fx2dev) {
+    spin_lock_irq(&fx2dev->int_lock);
+    fx2dev->int_running = 1;
+    fx2dev->int_backoff = 0;
+    spin_unlock_irq(&fx2dev->int_lock);
+
+    return osrfx2_int_resubmit(fx2dev);
+}
+
+/*Stop retries, then kill the URBs in flight. Callbacks of killed URBs
+  see int_running cleared and leave them idle*/
+static void osrfx2_int_stop(struct osrfx2 * fx2dev) {
+    spin_lock_irq(&fx2dev->int_lock);
+    fx2dev->int_running = 0;
+    spin_unlock_irq(&fx2dev->int_lock);
+
+    cancel_delayed_work_sync(&fx2dev->int_retry);
+    usb_kill_anchored_urbs(&fx2dev->int_anchor);
+}
+
+/*Bring failed interrupt URBs back, clearing a stall first*/
+static void osrfx2_int_retry(struct work_struct * work) {
+    struct osrfx2 *fx2dev = container_of(to_delayed_work(work), struct osrfx2, int_retry);
+    int halted;
+    int retval;
+
+    spin_lock_irq(&fx2dev->int_lock);
+    halted = fx2dev->int_halted;
+    fx2dev->int_halted = 0;
+    spin_unlock_irq(&fx2dev->int_lock);
+
+    if (halted) {
+        retval = usb_clear_halt(fx2dev->udev, usb_rcvintpipe(fx2dev->udev, fx2dev->int_in_endpointAddr));
+        if (retval)
+            dev_err(&fx2dev->udev->dev, "%s - usb_clear_halt failed: %d\n", __FUNCTION__, retval);
+    }
+
+    osrfx2_int_resubmit(fx2dev);
+}
+
+/*DIP switch interrupt handler. With int_count URBs queued the host
+  controller always has one to fill on the next polling interval*/
+static void interrupt_handler(struct urb * urb) {
+    struct osrfx2_int *in = urb->context;
+    struct osrfx2 *fx2dev = in->fx2dev;
+    unsigned char *buf = urb->transfer_buffer;
+    struct osrfx2_switch_event ev = { 0 };
+    struct osrfx2_file *client;
+    unsigned long flags;
+    int retval;
+
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, urb->status);
+    osrfx2_stat_complete(fx2dev, STAT_EP_INT_IN, urb->status, urb->actual_length);
+    usb_mark_last_busy(fx2dev->udev);
+
+    switch (urb->status) {
+    case 0:
+        break;
+
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        /*Killed or unplugged*/
+        spin_lock_irqsave(&fx2dev->int_lock, flags);
+        fx2dev->int_idle |= BIT(in->index);
+        spin_unlock_irqrestore(&fx2dev->int_lock, flags);
+        return;
+
+    default:
+        /*Transient error or stall, retry with backoff*/
+        dev_err_ratelimited(&urb->dev->dev, "%s - non-zero urb status received: %d\n",
+                            __FUNCTION__, urb->status);
+        spin_lock_irqsave(&fx2dev->int_lock, flags);
+        osrfx2_int_park(fx2dev, in, urb->status);
+        spin_unlock_irqrestore(&fx2dev->int_lock, flags);
+        return;
+    }
+
+    write_seqlock_irqsave(&fx2dev->switch_lock, flags);
+    fx2dev->switches = *buf; /*Get new switch state*/
+    fx2dev->switch_seq++;
+    write_sequnlock_irqrestore(&fx2dev->switch_lock, flags);
+    osrfx2_stat_int_event(fx2dev);
+
+    /*Queue the change for every event file, event_lock makes this the
+      only producer of each kfifo*/
+    ev.timestamp_ns = ktime_get_ns();
+    ev.switches     = *buf;
+    spin_lock_irqsave(&fx2dev->event_lock, flags);
+    list_for_each_entry(client, &fx2dev->event_files, event_node) {
+        if (!kfifo_put(&client->events, ev))
+            atomic64_inc(&fx2dev->stats.events_dropped);
+    }
+    spin_unlock_irqrestore(&fx2dev->event_lock, flags);
+
+    /*Wake pollers of the switches attribute*/
+    schedule_work(&fx2dev->notify_work);
+
+    wake_up(&(fx2dev->FieldEventQueue)); /*Wake-up any requests enqueued*/
+
+    /*Restart interrupt urb*/
+    spin_lock_irqsave(&fx2dev->int_lock, flags);
+    fx2dev->int_backoff = 0;
+    if (fx2dev->int_running) {
+        retval = osrfx2_int_submit(fx2dev, in, GFP_ATOMIC);
+        if (retval != 0) {
+            dev_err(&urb->dev->dev, "%s - error %d submitting interrupt urb\n", __FUNCTION__, retval);
+            osrfx2_int_park(fx2dev, in, retval);
+        }
+    }
+    else
+        fx2dev->int_idle |= BIT(in->index);
+    spin_unlock_irqrestore(&fx2dev->int_lock, flags);
+}
+
+/*Tell sysfs pollers the switches attribute changed. sysfs_notify can
+  sleep, so interrupt_handler defers it to here*/
+static void osrfx2_notify_work(struct work_struct * work) {
+    struct osrfx2 *fx2dev = container_of(work, struct osrfx2, notify_work);
+    struct usb_interface *intf = fx2dev->interface;
+
+    if (intf)
+        sysfs_notify(&intf->dev.kobj, NULL, dev_attr_switches.attr.name);
+}
+
+/*Retreive the values of the switches*/
+static ssize_t get_switches(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface   *intf   = to_usb_interface(dev);
+    struct osrfx2          *fx2dev = usb_get_intfdata(intf);    
+
+    /*left sw --> right sw*/
+    memcpy(buf, bits_str[osrfx2_switches(fx2dev, NULL)], BITS_STR_LEN + 1);
+
+    return BITS_STR_LEN;
+}
+
+/*Allocate the async SET urb of a register*/
+static int osrfx2_ctrl_alloc(struct osrfx2 * fx2dev, struct osrfx2_reg * reg) {
+    reg->fx2dev = fx2dev;
+
+    reg->urb    = usb_alloc_urb(0, GFP_KERNEL);
+    reg->setup  = kmalloc(sizeof(*reg->setup), GFP_KERNEL);
+    reg->buffer = kmalloc(sizeof(*reg->buffer), GFP_KERNEL);
+    if (!reg->urb || !reg->setup || !reg->buffer)
+        return -ENOMEM;
+
+    reg->setup->bRequestType = USB_DIR_OUT | USB_TYPE_VENDOR;
+    reg->setup->bRequest     = reg->set_cmd;
+    reg->setup->wValue       = 0;
+    reg->setup->wIndex       = 0;
+    reg->setup->wLength      = cpu_to_le16(sizeof(*reg->buffer));
+
+    usb_fill_control_urb(reg->urb, fx2dev->udev, usb_sndctrlpipe(fx2dev->udev, 0),
+                         (unsigned char *)reg->setup, reg->buffer, sizeof(*reg->buffer),
+                         ctrl_callback, reg);
+
+    return 0;
+}
+
+/*Free the async SET urb of a register. Nothing may be in flight*/
+static void osrfx2_ctrl_free(struct osrfx2 * fx2dev, struct osrfx2_reg * reg) {
+    usb_free_urb(reg->urb);
+    kfree(reg->setup);
+    kfree(reg->buffer);
+}
+
+/*Send the latest value of a register. Caller holds ctrl_lock*/
+static void osrfx2_ctrl_submit(struct osrfx2 * fx2dev, struct osrfx2_reg * reg) {
+    int retval;
+
+    if (reg->busy || !reg->dirty || fx2dev->ctrl_stopped)
+        return;
+
+    *reg->buffer  = reg->value;
+    reg->sent_seq = reg->seq;
+    reg->dirty    = 0;
+    reg->busy     = 1;
+
+    usb_anchor_urb(reg->urb, &fx2dev->ctrl_anchor);
+    reg->submit_ns = ktime_get_ns();
+    trace_osrfx2_submit(reg->urb, reg->urb->pipe, reg->urb->transfer_buffer_length, 0);
+    retval = usb_submit_urb(reg->urb, GFP_ATOMIC);
+    if (retval == 0)
+        osrfx2_stat_submit(fx2dev, STAT_EP_CTRL, sizeof(*reg->buffer));
+    else {
+        usb_unanchor_urb(reg->urb);
+        dev_err(&fx2dev->udev->dev, "%s - usb_submit_urb failed: %d\n", __FUNCTION__, retval);
+
+        /*Counts as done so barriers don't wait for it*/
+        reg->busy     = 0;
+        reg->done_seq = reg->sent_seq;
+        if (!reg->error)
+            reg->error = retval;
+        wake_up(&fx2dev->ctrl_wait);
+    }
+}
+
+static void ctrl_callback(struct urb * urb) {
+    struct osrfx2_reg *reg = urb->context;
+    struct osrfx2 *fx2dev = reg->fx2dev;
+    unsigned long flags;
+
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, urb->status);
+    osrfx2_stat_complete(fx2dev, STAT_EP_CTRL, urb->status, urb->actual_length);
+    osrfx2_stat_latency(fx2dev->stats.ctrl_lat, reg->submit_ns);
+    usb_mark_last_busy(fx2dev->udev);
+
+    spin_lock_irqsave(&fx2dev->ctrl_lock, flags);
+    reg->busy = 0;
+
+    if (urb->status == -ENOENT || urb->status == -ECONNRESET) {
+        /*Killed by suspend, send it again on resume unless superseded*/
+        if (reg->sent_seq == reg->seq)
+            reg->dirty = 1;
+    }
+    else {
+        if (urb->status) {
+            if (urb->status != -ESHUTDOWN)
+                dev_err(&urb->dev->dev, "%s - non-zero status received: %d\n", __FUNCTION__, urb->status);
+            if (!reg->error)
+                reg->error = urb->status;
+        }
+        reg->done_seq = reg->sent_seq;
+    }
+
+    /*Writes merged while this one was in flight*/
+    osrfx2_ctrl_submit(fx2dev, reg);
+
+    spin_unlock_irqrestore(&fx2dev->ctrl_lock, flags);
+
+    wake_up(&fx2dev->ctrl_wait);
+}
+
+/*Stop sending register writes and cancel the ones in flight*/
+static void osrfx2_ctrl_stop(struct osrfx2 * fx2dev) {
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    fx2dev->ctrl_stopped = 1;
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    usb_kill_anchored_urbs(&fx2dev->ctrl_anchor);
+    wake_up(&fx2dev->ctrl_wait);
+}
+
+/*Resume sending register writes*/
+static void osrfx2_ctrl_start(struct osrfx2 * fx2dev) {
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    fx2dev->ctrl_stopped = 0;
+    osrfx2_ctrl_submit(fx2dev, &fx2dev->leds);
+    osrfx2_ctrl_submit(fx2dev, &fx2dev->segments);
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+}
+
+/*Queue a register write and return right away. The value is cached at
+  once and merged with any write not yet sent*/
+static int osrfx2_reg_write(struct osrfx2 * fx2dev, struct osrfx2_reg * reg, unsigned char value) {
+    spin_lock_irq(&fx2dev->ctrl_lock);
+
+    reg->value = value;
+    reg->valid = 1;
+    reg->stamp = jiffies;
+    reg->dirty = 1;
+    reg->seq++;
+    osrfx2_ctrl_submit(fx2dev, reg);
+
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+    return 0;
+}
+
+/*True once the device took every write queued up to target*/
+static int osrfx2_reg_settled(struct osrfx2 * fx2dev, struct osrfx2_reg * reg, unsigned int target) {
+    int settled;
+
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    settled = ((int)(reg->done_seq - target) >= 0);
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    return settled;
+}
+
+/*Barrier. Wait for the register writes queued so far to reach the device
+  and report the first failure since the last barrier*/
+static int osrfx2_ctrl_sync(struct osrfx2 * fx2dev) {
+    unsigned int leds_seq, segments_seq;
+    long timeout;
+    int retval;
+
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    leds_seq     = fx2dev->leds.seq;
+    segments_seq = fx2dev->segments.seq;
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    timeout = wait_event_interruptible_timeout(fx2dev->ctrl_wait,
+                  (osrfx2_reg_settled(fx2dev, &fx2dev->leds, leds_seq) &&
+                   osrfx2_reg_settled(fx2dev, &fx2dev->segments, segments_seq)) ||
+                  !fx2dev->interface,
+                  msecs_to_jiffies(CTRL_SYNC_TIMEOUT));
+    if (timeout < 0)
+        return timeout;
+    if (!fx2dev->interface) /*Disconnect() was called*/
+        return -ENODEV;
+    if (!timeout)
+        return -ETIMEDOUT;
+
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    retval = fx2dev->leds.error ? fx2dev->leds.error : fx2dev->segments.error;
+    fx2dev->leds.error     = 0;
+    fx2dev->segments.error = 0;
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    return retval;
+}
+
+/*Register read completion, wakes osrfx2_ctrl_in*/
+static void ctrl_in_callback(struct urb * urb) {
+    complete(urb->context);
+}
+
+/*Read one byte with a vendor request. The urb sits on ctrl_anchor so
+  disconnect cancels it at once. Caller holds ctrl_mutex*/
+static int osrfx2_ctrl_in(struct osrfx2 * fx2dev, __u8 request, unsigned char * value) {
+    struct urb *urb = fx2dev->ctrl_in_urb;
+    u64 start = ktime_get_ns();
+    int retval;
+
+    fx2dev->ctrl_in_setup->bRequestType = USB_DIR_IN | USB_TYPE_VENDOR;
+    fx2dev->ctrl_in_setup->bRequest     = request;
+    fx2dev->ctrl_in_setup->wValue       = 0;
+    fx2dev->ctrl_in_setup->wIndex       = 0;
+    fx2dev->ctrl_in_setup->wLength      = cpu_to_le16(sizeof(*fx2dev->ctrl_buf));
+    usb_fill_control_urb(urb, fx2dev->udev, usb_rcvctrlpipe(fx2dev->udev, 0),
+                         (unsigned char *)fx2dev->ctrl_in_setup, fx2dev->ctrl_buf,
+                         sizeof(*fx2dev->ctrl_buf), ctrl_in_callback, &fx2dev->ctrl_in_done);
+    reinit_completion(&fx2dev->ctrl_in_done);
+
+    osrfx2_stat_submit(fx2dev, STAT_EP_CTRL, 0);
+    trace_osrfx2_submit(urb, urb->pipe, sizeof(*fx2dev->ctrl_buf), 0);
+    usb_anchor_urb(urb, &fx2dev->ctrl_anchor);
+    retval = usb_submit_urb(urb, GFP_KERNEL);
+    if (retval) {
+        usb_unanchor_urb(urb);
+        if (retval == -EPERM) /*Poisoned by disconnect*/
+            retval = -ENODEV;
+    }
+    else if (!wait_for_completion_timeout(&fx2dev->ctrl_in_done, msecs_to_jiffies(USB_CTRL_GET_TIMEOUT))) {
+        usb_kill_urb(urb);
+        retval = -ETIMEDOUT;
+    }
+    else {
+        retval = urb->status;
+        if (retval == 0 && urb->actual_length != sizeof(*fx2dev->ctrl_buf))
+            retval = -EIO;
+    }
+    trace_osrfx2_complete(urb, urb->pipe, urb->actual_length, retval);
+    osrfx2_stat_complete(fx2dev, STAT_EP_CTRL, retval, urb->actual_length);
+    osrfx2_stat_latency(fx2dev->stats.ctrl_lat, start);
+    if (retval < 0) {
+        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        return retval;
+    }
+
+    *value = *fx2dev->ctrl_buf;
+    return 0;
+}
+
+/*Get a register value, from the cache unless it is cold or stale or
+  force is set. -EAGAIN means the device is suspended and nothing is cached*/
+static int osrfx2_reg_read(struct osrfx2 * fx2dev, struct osrfx2_reg * reg, int force, unsigned char * value) {
+    unsigned int seq;
+    unsigned char hw;
+    int retval = 0;
+
+    /*Cache hits only need ctrl_lock, readers don't queue up on ctrl_mutex*/
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    if (!force && reg->valid &&
+        !(readback_ms > 0 && time_after(jiffies, reg->stamp + msecs_to_jiffies(readback_ms)))) {
+        *value = reg->value;
+        spin_unlock_irq(&fx2dev->ctrl_lock);
+        return 0;
+    }
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    mutex_lock(&fx2dev->ctrl_mutex);
+
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    if (!force && reg->valid &&
+        !(readback_ms > 0 && time_after(jiffies, reg->stamp + msecs_to_jiffies(readback_ms)))) {
+        spin_unlock_irq(&fx2dev->ctrl_lock);
+        goto exit;
+    }
+    seq = reg->seq;
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+    if (READ_ONCE(fx2dev->suspended)) {
+        if (!reg->valid)
+            retval = -EAGAIN;
+        goto exit;
+    }
+
+    /*Let queued writes land first so the readback isn't stale*/
+    wait_event_interruptible_timeout(fx2dev->ctrl_wait, osrfx2_reg_settled(fx2dev, reg, seq),
+                                     msecs_to_jiffies(CTRL_SYNC_TIMEOUT));
+
+    retval = osrfx2_ctrl_in(fx2dev, reg->read_cmd, &hw);
+    if (retval < 0)
+        goto exit;
+
+    /*A write queued meanwhile is newer than what was read*/
+    spin_lock_irq(&fx2dev->ctrl_lock);
+    if (reg->seq == seq) {
+        reg->value = hw;
+        reg->valid = 1;
+        reg->stamp = jiffies;
+    }
+    spin_unlock_irq(&fx2dev->ctrl_lock);
+
+exit:
+    *value = reg->value;
+    mutex_unlock(&fx2dev->ctrl_mutex);
+    return retval;
+}
+
+/*Gets the LED bargraph status on the device*/
+static ssize_t get_bargraph(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char leds;
+    int retval;
+
+    retval = osrfx2_pm_get(fx2dev, 0);
+    if (retval == 0) {
+        retval = osrfx2_reg_read(fx2dev, &fx2dev->leds, 0, &leds);
+        osrfx2_pm_put(fx2dev);
+    }
+    if (retval == -EAGAIN)
+        return sprintf(buf, "S ");   /*Device is suspended*/
+    if (retval < 0)
+        return retval;
+
+    /*Fill buffer with LED status*/
+    memcpy(buf, bits_str[leds_dec[leds]], BITS_STR_LEN + 1);
+
+    return BITS_STR_LEN;
+}
+
+/*Sets the LED bargraph on the device*/
 static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr, const char *buf,size_t count) {
     struct usb_interface  *intf   = to_usb_interface(dev);
     struct osrfx2         *fx2dev = usb_get_intfdata(intf);
 
     unsigned int value;
-    int retval;
+    unsigned char leds = 0;
     char *end;
 
-    fx2dev->leds = 0;
-
     /*convert buffer to unsigned long*/
     value = (simple_strtoul(buf, &end, 10) & 0xFF);
     if (buf == end)
@@ -666,26 +3549,16 @@ static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr,
 
     /*Check range of value 0 =< value < 256*/    
     if(value > 255)
-        fx2dev->leds = 0;
-    else { /*convert to intuitive bit system. bit 0 = bottom, bit 7 = top*/
-        fx2dev->leds |= ((value >> 3) & 0x01);
-        fx2dev->leds |= ((value >> 3) & 0x02);
-        fx2dev->leds |= ((value >> 3) & 0x04);
-        fx2dev->leds |= ((value >> 3) & 0x08);
-        fx2dev->leds |= ((value >> 3) & 0x10);
-        fx2dev->leds |= ((value << 5) & 0x20);
-        fx2dev->leds |= ((value << 5) & 0x40);
-        fx2dev->leds |= ((value << 5) & 0x80);
-    }
-
-    /*Set LED values*/
-    retval = usb_control_msg(fx2dev->udev, usb_sndctrlpipe(fx2dev->udev, 0),
-                             SET_LEDS, USB_DIR_OUT | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->leds, sizeof(fx2dev->leds),
-                             USB_CTRL_GET_TIMEOUT);
-
-    if (retval < 0)
-        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        leds = 0;
+    else /*convert to intuitive bit system. bit 0 = bottom, bit 7 = top*/
+        leds = leds_enc[value];
+
+    /*Set LED values. The write is queued, osrfx2_pm_busy keeps the
+      device up until it went out*/
+    if (osrfx2_pm_get(fx2dev, 0) == 0) {
+        osrfx2_reg_write(fx2dev, &fx2dev->leds, leds);
+        osrfx2_pm_put(fx2dev);
+    }
 
     return count;
 }
@@ -694,37 +3567,23 @@ static ssize_t set_bargraph(struct device * dev, struct device_attribute *attr,
 static ssize_t get_7segment(struct device *dev, struct device_attribute *attr, char *buf) {
     struct usb_interface  *intf   = to_usb_interface(dev);
     struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char segments;
     int retval;
-   
-    if (fx2dev->suspended) {
-        return sprintf(buf, "S ");   /*Device is suspended*/
-    }
-
-    fx2dev->segments = 0;
-
-    /*Get 7segment values*/
-    retval = usb_control_msg(fx2dev->udev, usb_rcvctrlpipe(fx2dev->udev, 0),
-                             READ_7SEG, USB_DIR_IN | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->segments, sizeof(fx2dev->segments),
-                             USB_CTRL_GET_TIMEOUT);
 
-    if (retval < 0) {
-        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
-        return retval;
+    retval = osrfx2_pm_get(fx2dev, 0);
+    if (retval == 0) {
+        retval = osrfx2_reg_read(fx2dev, &fx2dev->segments, 0, &segments);
+        osrfx2_pm_put(fx2dev);
     }
+    if (retval == -EAGAIN)
+        return sprintf(buf, "S ");   /*Device is suspended*/
+    if (retval < 0)
+        return retval;
 
     /*Fill buffer with 7 segment status*/
-    retval = sprintf(buf, "%s%s%s%s%s%s%s%s",
-                     (fx2dev->segments & 0x08) ? "1" : "0",
-                     (fx2dev->segments & 0x20) ? "1" : "0",
-                     (fx2dev->segments & 0x40) ? "1" : "0",
-                     (fx2dev->segments & 0x10) ? "1" : "0",
-                     (fx2dev->segments & 0x80) ? "1" : "0",
-                     (fx2dev->segments & 0x04) ? "1" : "0",
-                     (fx2dev->segments & 0x02) ? "1" : "0",
-                     (fx2dev->segments & 0x01) ? "1" : "0");
+    memcpy(buf, bits_str[seg_dec[segments]], BITS_STR_LEN + 1);
 
-    return retval;
+    return BITS_STR_LEN;
 }
 
 /*Set 7 segment display on device*/
@@ -733,11 +3592,9 @@ static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, c
     struct osrfx2         *fx2dev = usb_get_intfdata(intf);
 
     unsigned int value;
-    int retval;
+    unsigned char segments = 0;
     char *end;
 
-    fx2dev->segments = 0;
-
     /*convert buffer to unsigned long*/
     value = (simple_strtoul(buf, &end, 10) & 0xFF);
     if (buf == end)
@@ -745,28 +3602,84 @@ static ssize_t set_7segment(struct device *dev, struct device_attribute *attr, c
 
     /*Check range of value 0 =< value < 256*/    
     if(value > 255)
-        fx2dev->segments = 0;
-    else { /*convert to intuitive bit system. bit 0 = seg a, bit 7 = decimal*/
-        fx2dev->segments |= (value & 0x01);
-        fx2dev->segments |= (value & 0x02);
-        fx2dev->segments |= (value & 0x04);
-        fx2dev->segments |= ((value >> 4) & 0x08);
-        fx2dev->segments |= (value & 0x10);
-        fx2dev->segments |= ((value >> 1) & 0x20);
-        fx2dev->segments |= ((value << 1) & 0x40);
-        fx2dev->segments |= ((value << 4) & 0x80);
-    }
+        segments = 0;
+    else /*convert to intuitive bit system. bit 0 = seg a, bit 7 = decimal*/
+        segments = seg_enc[value];
 
     /*Set values*/
-    retval = usb_control_msg(fx2dev->udev, usb_sndctrlpipe(fx2dev->udev, 0),
-                             SET_7SEG, USB_DIR_OUT | USB_TYPE_VENDOR, 0, 0,
-                             &fx2dev->segments, sizeof(fx2dev->segments),
-                             USB_CTRL_GET_TIMEOUT);
+    if (osrfx2_pm_get(fx2dev, 0) == 0) {
+        osrfx2_reg_write(fx2dev, &fx2dev->segments, segments);
+        osrfx2_pm_put(fx2dev);
+    }
+
+    return count;
+}
+
+/*Force the cached bargraph and 7 segment values to be read back from the device*/
+static ssize_t set_refresh(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    unsigned char value;
+    int retval;
 
+    retval = osrfx2_pm_get(fx2dev, 0);
     if (retval < 0)
-        dev_err(&fx2dev->udev->dev, "%s - retval=%d\n", __FUNCTION__, retval);
+        return retval;
 
-    return count;
+    retval = osrfx2_reg_read(fx2dev, &fx2dev->leds, 1, &value);
+    if (retval == 0)
+        retval = osrfx2_reg_read(fx2dev, &fx2dev->segments, 1, &value);
+
+    osrfx2_pm_put(fx2dev);
+
+    return retval < 0 ? retval : count;
+}
+
+/*Bulk transfer sizing chosen at probe*/
+static ssize_t get_link_speed(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct osrfx2 *fx2dev = usb_get_intfdata(to_usb_interface(dev));
+
+    return sprintf(buf, "%s\n", fx2dev->high_speed ? "high" : "full");
+}
+
+static ssize_t get_read_urbs(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct osrfx2 *fx2dev = usb_get_intfdata(to_usb_interface(dev));
+
+    return sprintf(buf, "%d\n", fx2dev->rx_count);
+}
+
+static ssize_t get_read_urb_size(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct osrfx2 *fx2dev = usb_get_intfdata(to_usb_interface(dev));
+
+    return sprintf(buf, "%zu\n", fx2dev->rx_size);
+}
+
+static ssize_t get_write_urbs(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct osrfx2 *fx2dev = usb_get_intfdata(to_usb_interface(dev));
+
+    return sprintf(buf, "%d\n", fx2dev->tx_count);
+}
+
+static ssize_t get_write_urb_size(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct osrfx2 *fx2dev = usb_get_intfdata(to_usb_interface(dev));
+
+    return sprintf(buf, "%zu\n", fx2dev->tx_size);
+}
+
+/*Wait until queued bargraph and 7 segment writes reached the device*/
+static ssize_t set_sync(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct usb_interface  *intf   = to_usb_interface(dev);
+    struct osrfx2         *fx2dev = usb_get_intfdata(intf);
+    int retval;
+
+    retval = osrfx2_pm_get(fx2dev, 0);
+    if (retval < 0)
+        return retval;
+
+    retval = osrfx2_ctrl_sync(fx2dev);
+
+    osrfx2_pm_put(fx2dev);
+    return retval < 0 ? retval : count;
 }
 
 MODULE_DESCRIPTION("OSR FX2 Linux Driver");
@@ -0,0 +1,1206 @@
+/*****************************************************
+ * Benchmark for the OSR FX2 board driver            *
+ * Streams blocks through the bulk loopback, or      *
+ * drives the control path, and reports throughput,  *
+ * latency percentiles and CPU usage. Runs scripted  *
+ * scenarios with JSON output and baseline checks    *
+ *****************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+
+#include "osrfx2_ioctl.h"
+
+#define DEF_DEVICE   "/dev/osrfx2_0"
+#define DEF_SYSFS    "/sys/class/usb/osrfx2_0/device"
+#define DEF_BLOCK    4096
+#define DEF_DEPTH    8
+#define DEF_SECONDS  5
+#define MAX_DEPTH    64             /*Blocks in flight through the loopback*/
+#define MAX_SAMPLES  (1 << 20)      /*Latency samples kept*/
+#define DRAIN_TIME   2000           /*ms to wait for data still in the loopback*/
+#define SUSPEND_WAIT 30000          /*ms to wait for the board to autosuspend*/
+#define DEF_TOLERANCE 10            /*Percent a metric may be worse than its baseline*/
+#define MAX_ARGS     32             /*Words on one scenario line*/
+#define LINE_LEN     512
+
+enum { MODE_RW, MODE_AIO, MODE_MMAP, MODE_IOCTL, MODE_SYSFS,
+       MODE_EVENTS, MODE_CONTEND, MODE_SUSPEND, MODE_COUNT };
+
+static const char *mode_names[MODE_COUNT] = { "rw", "aio", "mmap", "ioctl", "sysfs",
+                                              "events", "contend", "suspend" };
+
+struct bench {
+    /*Options*/
+    const char * name;              /*Scenario name in JSON and baseline lookups*/
+    int          mode;
+    const char * device;
+    const char * sysfs;
+    size_t       block;             /*Bytes per block*/
+    int          depth;             /*Blocks in flight*/
+    int          seconds;
+    int          verify;            /*Check the loopback data*/
+    int          nosync;            /*Control modes skip the sync barrier*/
+    int          duplex;            /*rw and aio share one O_RDWR file*/
+
+    /*Loopback progress, shared by the writer and the reader*/
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;
+    unsigned long long blocks_out;  /*Blocks handed to the driver*/
+    unsigned long long blocks_in;   /*Blocks fully read back*/
+    unsigned long long bytes_in;
+    uint64_t           submit_ns[MAX_DEPTH]; /*By block number % MAX_DEPTH*/
+    unsigned long long mismatches;
+    uint64_t           last_in_ns;  /*Time the last data came back*/
+    volatile int       stop;
+    volatile int       writer_done;
+    volatile int       reader_done;
+    int                error;       /*First errno seen by a thread*/
+
+    /*Latency samples in ns, per block or per control operation*/
+    uint64_t         * samples;
+    unsigned long      nr_samples;
+    unsigned long long ops;         /*Control operations, events, opens or suspend cycles*/
+
+    /*contend: open() results and files holding each bulk pipe, by is_out*/
+    unsigned long long granted;
+    unsigned long long busy;
+    int                holders[2];
+
+    /*mmap ring*/
+    struct osrfx2_mmap_info info;
+    unsigned char    * ring;
+    int                fd;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*Loopback data pattern, by offset in the stream*/
+static unsigned char pattern(unsigned long long offset) {
+    return (unsigned char)(offset + (offset >> 8) + (offset >> 16));
+}
+
+static void fill_block(struct bench *b, unsigned char *buf, unsigned long long blockno) {
+    unsigned long long offset = blockno * b->block;
+    size_t i;
+
+    for (i = 0; i < b->block; i++)
+        buf[i] = pattern(offset + i);
+}
+
+static void add_sample(struct bench *b, uint64_t ns) {
+    if (b->nr_samples < MAX_SAMPLES)
+        b->samples[b->nr_samples++] = ns;
+}
+
+static void set_error(struct bench *b, int err) {
+    pthread_mutex_lock(&b->lock);
+    if (!b->error)
+        b->error = err;
+    b->stop = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+/*Wait until one more block fits in the loopback, then claim its number.
+  Returns -1 once the run is over*/
+static long long next_block(struct bench *b) {
+    long long blockno = -1;
+
+    pthread_mutex_lock(&b->lock);
+    while (!b->stop && b->blocks_out - b->blocks_in >= (unsigned long long)b->depth)
+        pthread_cond_wait(&b->cond, &b->lock);
+    if (!b->stop) {
+        blockno = b->blocks_out++;
+        b->submit_ns[blockno % MAX_DEPTH] = now_ns();
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return blockno;
+}
+
+/*Account for data read back and time every block it completes*/
+static void account_in(struct bench *b, const unsigned char *data, size_t len) {
+    unsigned long long offset;
+    uint64_t now = now_ns();
+    size_t i;
+
+    pthread_mutex_lock(&b->lock);
+    offset = b->bytes_in;
+    b->bytes_in += len;
+    b->last_in_ns = now;
+
+    while (b->blocks_in < b->blocks_out && b->bytes_in >= (b->blocks_in + 1) * b->block) {
+        add_sample(b, now - b->submit_ns[b->blocks_in % MAX_DEPTH]);
+        b->blocks_in++;
+    }
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+
+    if (b->verify) {
+        for (i = 0; i < len; i++)
+            if (data[i] != pattern(offset + i))
+                b->mismatches++;
+    }
+}
+
+/*True once everything written came back, or nothing more will*/
+static int drained(struct bench *b) {
+    int done;
+
+    pthread_mutex_lock(&b->lock);
+    done = b->stop && b->writer_done && b->blocks_in >= b->blocks_out;
+    pthread_mutex_unlock(&b->lock);
+
+    return done;
+}
+
+/*************************rw: write() and read()*************************/
+static void *rw_writer(void *arg) {
+    struct bench *b = arg;
+    unsigned char *buf = malloc(b->block);
+    long long blockno;
+    size_t done;
+    ssize_t len;
+    int fd;
+
+    fd = b->duplex ? b->fd : open(b->device, O_WRONLY);
+    if (fd == -1 || !buf) {
+        set_error(b, errno);
+        goto exit;
+    }
+
+    if (!b->verify)
+        fill_block(b, buf, 0);
+
+    while ((blockno = next_block(b)) >= 0) {
+        if (b->verify)
+            fill_block(b, buf, blockno);
+
+        for (done = 0; done < b->block; done += len) {
+            len = write(fd, buf + done, b->block - done);
+            if (len < 0) {
+                if (errno != EINTR)
+                    set_error(b, errno);
+                goto exit;
+            }
+        }
+    }
+
+exit:
+    if (fd != -1 && !b->duplex)
+        close(fd);
+    free(buf);
+    b->writer_done = 1;
+    return NULL;
+}
+
+/*Reads for both rw and aio*/
+static void *rw_reader(void *arg) {
+    struct bench *b = arg;
+    unsigned char *buf = malloc(b->block);
+    ssize_t len;
+    int fd;
+
+    fd = b->duplex ? b->fd : open(b->device, O_RDONLY);
+    if (fd == -1 || !buf) {
+        set_error(b, errno);
+        goto exit;
+    }
+
+    while (!drained(b)) {
+        len = read(fd, buf, b->block);
+        if (len < 0) {
+            if (errno == EINTR && b->stop)
+                break;
+            if (errno != EINTR && errno != ETIMEDOUT) {
+                set_error(b, errno);
+                break;
+            }
+            continue;
+        }
+        account_in(b, buf, len);
+    }
+
+exit:
+    if (fd != -1 && !b->duplex)
+        close(fd);
+    free(buf);
+    b->reader_done = 1;
+    return NULL;
+}
+
+/*************************aio: native async writes***********************/
+static long sys_io_setup(unsigned nr, aio_context_t *ctx) {
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static long sys_io_destroy(aio_context_t ctx) {
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static long sys_io_submit(aio_context_t ctx, long nr, struct iocb **iocbpp) {
+    return syscall(__NR_io_submit, ctx, nr, iocbpp);
+}
+
+static long sys_io_getevents(aio_context_t ctx, long min_nr, long nr,
+                             struct io_event *events, struct timespec *timeout) {
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, timeout);
+}
+
+static void *aio_writer(void *arg) {
+    struct bench *b = arg;
+    struct iocb iocbs[MAX_DEPTH], *iocbp;
+    struct io_event events[MAX_DEPTH];
+    struct timespec ts = { 0, 0 };
+    unsigned char *bufs = malloc(b->block * b->depth);
+    int free_slots[MAX_DEPTH];
+    int nr_free = 0, inflight = 0;
+    aio_context_t ctx = 0;
+    long long blockno;
+    long i, n;
+    int fd, slot;
+
+    fd = b->duplex ? b->fd : open(b->device, O_WRONLY);
+    if (fd == -1 || !bufs || sys_io_setup(b->depth, &ctx) < 0) {
+        set_error(b, errno);
+        goto exit;
+    }
+
+    for (slot = 0; slot < b->depth; slot++) {
+        if (!b->verify)
+            fill_block(b, bufs + slot * b->block, 0);
+        free_slots[nr_free++] = slot;
+    }
+
+    while (!b->stop || inflight) {
+        /*Reclaim finished writes, waiting only when every slot is busy*/
+        n = sys_io_getevents(ctx, (nr_free || b->stop) ? 0 : 1, b->depth, events, nr_free ? &ts : NULL);
+        if (n < 0 && errno != EINTR) {
+            set_error(b, errno);
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if ((long long)events[i].res < 0)
+                set_error(b, -(long long)events[i].res);
+            free_slots[nr_free++] = (int)events[i].data;
+            inflight--;
+        }
+
+        if (b->stop) {
+            if (inflight)
+                usleep(1000);
+            continue;
+        }
+        if (!nr_free)
+            continue;
+
+        blockno = next_block(b);
+        if (blockno < 0)
+            continue;
+
+        slot = free_slots[--nr_free];
+        if (b->verify)
+            fill_block(b, bufs + slot * b->block, blockno);
+
+        memset(&iocbs[slot], 0, sizeof(iocbs[slot]));
+        iocbs[slot].aio_data       = slot;
+        iocbs[slot].aio_lio_opcode = IOCB_CMD_PWRITE;
+        iocbs[slot].aio_fildes     = fd;
+        iocbs[slot].aio_buf        = (uint64_t)(uintptr_t)(bufs + slot * b->block);
+        iocbs[slot].aio_nbytes     = b->block;
+
+        iocbp = &iocbs[slot];
+        if (sys_io_submit(ctx, 1, &iocbp) != 1) {
+            set_error(b, errno);
+            free_slots[nr_free++] = slot;
+            continue;
+        }
+        inflight++;
+    }
+
+exit:
+    if (ctx)
+        sys_io_destroy(ctx);
+    if (fd != -1 && !b->duplex)
+        close(fd);
+    free(bufs);
+    b->writer_done = 1;
+    return NULL;
+}
+
+/*************************mmap: the zero-copy ring***********************/
+static void *mmap_writer(void *arg) {
+    struct bench *b = arg;
+    struct osrfx2_mmap_buf mb;
+    int depth = b->depth < (int)b->info.nr_out ? b->depth : (int)b->info.nr_out;
+    int free_slots[MAX_DEPTH];
+    int nr_free = 0, inflight = 0;
+    long long blockno;
+    unsigned char *buf;
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        if (!b->verify)
+            fill_block(b, b->ring + (b->info.nr_in + i) * b->info.buf_size, 0);
+        free_slots[nr_free++] = i;
+    }
+
+    while (!b->stop || inflight) {
+        if (!nr_free || (b->stop && inflight)) {
+            if (ioctl(b->fd, OSRFX2_IOC_REAP_OUT, &mb) < 0) {
+                if (errno != EINTR)
+                    set_error(b, errno);
+                if (b->stop)
+                    break;
+                continue;
+            }
+            if (mb.status)
+                set_error(b, -mb.status);
+            free_slots[nr_free++] = mb.index;
+            inflight--;
+            continue;
+        }
+
+        blockno = next_block(b);
+        if (blockno < 0)
+            continue;
+
+        memset(&mb, 0, sizeof(mb));
+        mb.index  = free_slots[--nr_free];
+        mb.length = b->block;
+        buf = b->ring + (b->info.nr_in + mb.index) * b->info.buf_size;
+        if (b->verify)
+            fill_block(b, buf, blockno);
+
+        if (ioctl(b->fd, OSRFX2_IOC_SUBMIT_OUT, &mb) < 0) {
+            set_error(b, errno);
+            free_slots[nr_free++] = mb.index;
+            continue;
+        }
+        inflight++;
+    }
+
+    b->writer_done = 1;
+    return NULL;
+}
+
+static void *mmap_reader(void *arg) {
+    struct bench *b = arg;
+    struct osrfx2_mmap_buf mb;
+    unsigned int i;
+
+    for (i = 0; i < b->info.nr_in; i++) {
+        memset(&mb, 0, sizeof(mb));
+        mb.index = i;
+        if (ioctl(b->fd, OSRFX2_IOC_SUBMIT_IN, &mb) < 0) {
+            set_error(b, errno);
+            goto exit;
+        }
+    }
+
+    while (!drained(b)) {
+        if (ioctl(b->fd, OSRFX2_IOC_REAP_IN, &mb) < 0) {
+            if (errno == EINTR && b->stop)
+                break;
+            if (errno != EINTR) {
+                set_error(b, errno);
+                break;
+            }
+            continue;
+        }
+        if (mb.status == 0)
+            account_in(b, b->ring + mb.index * b->info.buf_size, mb.length);
+
+        mb.length = 0;
+        if (ioctl(b->fd, OSRFX2_IOC_SUBMIT_IN, &mb) < 0) {
+            set_error(b, errno);
+            break;
+        }
+    }
+
+exit:
+    b->reader_done = 1;
+    return NULL;
+}
+
+static int mmap_setup(struct bench *b) {
+    size_t len;
+
+    b->fd = open(b->device, O_RDWR);
+    if (b->fd == -1)
+        return -1;
+
+    if (ioctl(b->fd, OSRFX2_IOC_MMAP_INFO, &b->info) < 0)
+        return -1;
+    if (b->block > b->info.buf_size) {
+        fprintf(stderr, "block size %zu is larger than the mmap buffers (%u)\n",
+                b->block, b->info.buf_size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    len = (size_t)(b->info.nr_in + b->info.nr_out) * b->info.buf_size;
+    b->ring = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (b->ring == MAP_FAILED) {
+        b->ring = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************Control path*******************************/
+static int open_attr(struct bench *b, const char *attr) {
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", b->sysfs, attr);
+    return open(path, O_WRONLY);
+}
+
+/*Set both displays per operation, then wait for the device unless nosync*/
+static int run_control(struct bench *b) {
+    struct osrfx2_display disp;
+    int bar = -1, seg = -1, sync = -1;
+    char str[8];
+    uint64_t end, start;
+    unsigned int value = 0;
+    int len, retval = -1;
+
+    if (b->mode == MODE_IOCTL) {
+        b->fd = open(b->device, O_RDONLY);
+        if (b->fd == -1)
+            return -1;
+    }
+    else {
+        bar  = open_attr(b, "bargraph");
+        seg  = open_attr(b, "7segment");
+        sync = open_attr(b, "sync");
+        if (bar == -1 || seg == -1 || sync == -1)
+            goto exit;
+    }
+
+    end = now_ns() + (uint64_t)b->seconds * 1000000000ULL;
+    while ((start = now_ns()) < end) {
+        value = (value + 1) & 0xFF;
+
+        if (b->mode == MODE_IOCTL) {
+            memset(&disp, 0, sizeof(disp));
+            disp.bargraph = value;
+            disp.segments = value;
+            disp.flags    = OSRFX2_DISPLAY_BARGRAPH | OSRFX2_DISPLAY_7SEG;
+            if (!b->nosync)
+                disp.flags |= OSRFX2_DISPLAY_SYNC;
+            if (ioctl(b->fd, OSRFX2_IOC_SET_DISPLAY, &disp) < 0)
+                goto exit;
+        }
+        else {
+            len = snprintf(str, sizeof(str), "%u", value);
+            if (pwrite(bar, str, len, 0) != len || pwrite(seg, str, len, 0) != len)
+                goto exit;
+            if (!b->nosync && pwrite(sync, "1", 1, 0) != 1)
+                goto exit;
+        }
+
+        add_sample(b, now_ns() - start);
+        b->ops++;
+    }
+    retval = 0;
+
+exit:
+    if (bar != -1) close(bar);
+    if (seg != -1) close(seg);
+    if (sync != -1) close(sync);
+    return retval;
+}
+
+/******************************Switch events*****************************/
+/*Time from the interrupt reaching the driver until read() returns the
+  event. Somebody, or a fixture, has to work the switches meanwhile*/
+static int run_events(struct bench *b) {
+    struct osrfx2_switch_event ev;
+    struct pollfd pfd;
+    uint64_t end, now;
+
+    b->fd = open(b->device, O_RDONLY | O_NONBLOCK);
+    if (b->fd == -1 || ioctl(b->fd, OSRFX2_IOC_EVENT_MODE) < 0)
+        return -1;
+
+    end = now_ns() + (uint64_t)b->seconds * 1000000000ULL;
+    while ((now = now_ns()) < end) {
+        pfd.fd     = b->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, (end - now) / 1000000 + 1) < 0 && errno != EINTR)
+            return -1;
+
+        while (read(b->fd, &ev, sizeof(ev)) == sizeof(ev)) {
+            add_sample(b, now_ns() - ev.timestamp_ns);
+            b->ops++;
+        }
+    }
+
+    /*Nothing measured is a failed run, not a pass*/
+    if (!b->nr_samples) {
+        fprintf(stderr, "no switch events, were the switches worked?\n");
+        errno = ENODATA;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*****************************Open contention****************************/
+struct contender {
+    struct bench *b;
+    int           flags;
+    pthread_t     thread;
+};
+
+/*Open and close one direction as fast as possible. The driver must never
+  let two files hold the same bulk pipe, anything else counts as a
+  mismatch. A file gives its claim up here before close, so the next
+  holder can't be counted early*/
+static void *contend_thread(void *arg) {
+    struct contender *c = arg;
+    struct bench *b = c->b;
+    int in  = c->flags != O_WRONLY;
+    int out = c->flags != O_RDONLY;
+    uint64_t start, lat;
+    int fd, err;
+
+    while (!b->stop) {
+        start = now_ns();
+        fd  = open(b->device, c->flags);
+        err = errno;
+        lat = now_ns() - start;
+
+        pthread_mutex_lock(&b->lock);
+        add_sample(b, lat);
+        b->ops++;
+        if (fd != -1) {
+            b->granted++;
+            if (in && b->holders[0]++)
+                b->mismatches++;
+            if (out && b->holders[1]++)
+                b->mismatches++;
+        }
+        else if (err == EBUSY)
+            b->busy++;
+        pthread_mutex_unlock(&b->lock);
+
+        if (fd == -1) {
+            if (err != EBUSY && err != EINTR) {
+                set_error(b, err);
+                break;
+            }
+            continue;
+        }
+
+        sched_yield();
+
+        pthread_mutex_lock(&b->lock);
+        b->holders[0] -= in;
+        b->holders[1] -= out;
+        pthread_mutex_unlock(&b->lock);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/*depth threads cycle through O_RDONLY, O_WRONLY and O_RDWR opens*/
+static int run_contend(struct bench *b) {
+    static const int flags[] = { O_RDONLY, O_WRONLY, O_RDWR };
+    struct contender c[MAX_DEPTH];
+    int i, started;
+
+    for (started = 0; started < b->depth; started++) {
+        c[started].b     = b;
+        c[started].flags = flags[started % 3];
+        if (pthread_create(&c[started].thread, NULL, contend_thread, &c[started]))
+            break;
+    }
+
+    if (started == b->depth)
+        sleep(b->seconds);
+    else
+        set_error(b, EAGAIN);
+
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_mutex_unlock(&b->lock);
+    for (i = 0; i < started; i++)
+        pthread_join(c[i].thread, NULL);
+
+    return b->error ? (errno = b->error, -1) : 0;
+}
+
+/**************************Suspend and resume****************************/
+static int runtime_suspended(struct bench *b) {
+    char path[256], status[32];
+    ssize_t len;
+    int fd;
+
+    /*The interface directory's parent is the usb device*/
+    snprintf(path, sizeof(path), "%s/../power/runtime_status", b->sysfs);
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    len = pread(fd, status, sizeof(status) - 1, 0);
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    status[len] = '\0';
+    return !strncmp(status, "suspended", 9);
+}
+
+/*Send one block through the loopback and read all of it back*/
+static int round_trip(struct bench *b, const unsigned char *out, unsigned char *in) {
+    size_t done;
+    ssize_t len;
+
+    for (done = 0; done < b->block; done += len) {
+        len = write(b->fd, out + done, b->block - done);
+        if (len < 0)
+            return -1;
+    }
+    for (done = 0; done < b->block; done += len) {
+        len = read(b->fd, in + done, b->block - done);
+        if (len < 0)
+            return -1;
+    }
+
+    b->bytes_in += b->block;
+    if (b->verify && memcmp(out, in, b->block))
+        b->mismatches++;
+    return 0;
+}
+
+/*Let the board autosuspend, wake it with a burst of depth round trips
+  and time the first one, which includes the resume. Repeats for the run
+  time. Needs runtime PM enabled for the board (autosuspend_ms)*/
+static int run_suspend(struct bench *b) {
+    unsigned char *out = malloc(b->block);
+    unsigned char *in  = malloc(b->block);
+    uint64_t end, deadline, start;
+    int retval = -1;
+    int i, state;
+
+    b->fd = open(b->device, O_RDWR);
+    if (b->fd == -1 || !out || !in)
+        goto exit;
+    fill_block(b, out, 0);
+
+    end = now_ns() + (uint64_t)b->seconds * 1000000000ULL;
+    while (now_ns() < end) {
+        deadline = now_ns() + SUSPEND_WAIT * 1000000ULL;
+        while ((state = runtime_suspended(b)) == 0) {
+            if (now_ns() > deadline) {
+                fprintf(stderr, "board did not autosuspend, is runtime PM enabled?\n");
+                errno = ETIMEDOUT;
+                goto exit;
+            }
+            usleep(10000);
+        }
+        if (state < 0)
+            goto exit;
+
+        for (i = 0; i < b->depth; i++) {
+            start = now_ns();
+            if (round_trip(b, out, in) < 0)
+                goto exit;
+            if (i == 0)
+                add_sample(b, now_ns() - start);
+        }
+        b->ops++;
+    }
+    retval = 0;
+
+exit:
+    free(out);
+    free(in);
+    return retval;
+}
+
+/*******************************Loopback*********************************/
+static void wake_handler(int sig) {
+    (void)sig;  /*Only there to interrupt blocking calls*/
+}
+
+/*Interrupt a thread until it noticed the run is over*/
+static void stop_thread(pthread_t thread, volatile int *done) {
+    while (!*done) {
+        pthread_kill(thread, SIGUSR1);
+        usleep(10000);
+    }
+    pthread_join(thread, NULL);
+}
+
+static int run_loopback(struct bench *b) {
+    void *(*writer)(void *) = rw_writer;
+    void *(*reader)(void *) = rw_reader;
+    struct sigaction sa;
+    pthread_t wt, rt;
+    uint64_t deadline;
+
+    /*No SA_RESTART, so SIGUSR1 makes blocking calls return EINTR*/
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wake_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (b->duplex) {
+        b->fd = open(b->device, O_RDWR);
+        if (b->fd == -1)
+            return -1;
+    }
+
+    if (b->mode == MODE_AIO)
+        writer = aio_writer;
+    else if (b->mode == MODE_MMAP) {
+        if (mmap_setup(b) < 0)
+            return -1;
+        writer = mmap_writer;
+        reader = mmap_reader;
+    }
+
+    if (pthread_create(&rt, NULL, reader, b) || pthread_create(&wt, NULL, writer, b))
+        return -1;
+
+    sleep(b->seconds);
+
+    pthread_mutex_lock(&b->lock);
+    b->stop = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+
+    /*Give data still in the loopback a chance to come back*/
+    deadline = now_ns() + DRAIN_TIME * 1000000ULL;
+    while (!drained(b) && !b->reader_done && now_ns() < deadline)
+        usleep(10000);
+
+    stop_thread(wt, &b->writer_done);
+    stop_thread(rt, &b->reader_done);
+
+    if (b->ring)
+        munmap(b->ring, (size_t)(b->info.nr_in + b->info.nr_out) * b->info.buf_size);
+
+    return b->error ? (errno = b->error, -1) : 0;
+}
+
+/*******************************Reporting********************************/
+/*Numbers of one run, shared by the text and JSON reports and the
+  baseline check*/
+struct result {
+    double elapsed;
+    double mb_per_s;                /*Loopback modes*/
+    double ops_per_s;               /*The others*/
+    double lat[6];                  /*us: min p50 p90 p99 p99.9 max*/
+    double user, sys;               /*Percent of one core*/
+    int    error;                   /*errno of a failed run, 0 if it completed*/
+    int    regressions;
+};
+
+static const char *lat_names[6] = { "min", "p50", "p90", "p99", "p99.9", "max" };
+static const double lat_pcts[6] = { 0, 50, 90, 99, 99.9, 100 };
+
+/*Options that apply to a whole suite of runs*/
+struct suite {
+    const char * scenarios;         /*File with one run per line, NULL for a single run*/
+    const char * baseline;          /*Earlier JSON output to compare against*/
+    char       * baseline_text;
+    double       tolerance;         /*Percent*/
+    int          json;
+    int          runs;              /*Results printed so far*/
+};
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct bench *b, double p) {
+    unsigned long i;
+
+    if (!b->nr_samples)
+        return 0;
+    i = (unsigned long)(p / 100.0 * (b->nr_samples - 1) + 0.5);
+    return b->samples[i] / 1000.0;
+}
+
+static double tv_sec(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int is_loopback(int mode) {
+    return mode <= MODE_MMAP || mode == MODE_SUSPEND;
+}
+
+static void summarize(struct bench *b, struct result *r, double elapsed,
+                      struct rusage *ru0, struct rusage *ru1) {
+    int i;
+
+    qsort(b->samples, b->nr_samples, sizeof(*b->samples), cmp_u64);
+
+    r->elapsed   = elapsed;
+    r->mb_per_s  = is_loopback(b->mode) ? b->bytes_in / elapsed / 1e6 : 0;
+    r->ops_per_s = b->ops / elapsed;
+    for (i = 0; i < 6; i++)
+        r->lat[i] = percentile(b, lat_pcts[i]);
+    r->user = 100 * (tv_sec(ru1->ru_utime) - tv_sec(ru0->ru_utime)) / elapsed;
+    r->sys  = 100 * (tv_sec(ru1->ru_stime) - tv_sec(ru0->ru_stime)) / elapsed;
+}
+
+static void report(struct bench *b, struct result *r) {
+    printf("mode %s", mode_names[b->mode]);
+    if (b->mode <= MODE_MMAP) {
+        printf(" block %zu depth %d\n", b->block, b->depth);
+        printf("throughput: %.2f MB/s (%llu blocks, %llu bytes in %.2f s)\n",
+               r->mb_per_s, b->blocks_in, b->bytes_in, r->elapsed);
+    }
+    else if (b->mode == MODE_CONTEND) {
+        printf(" threads %d\n", b->depth);
+        printf("opens: %.0f/s, %llu granted, %llu busy, %llu exclusivity violations\n",
+               r->ops_per_s, b->granted, b->busy, b->mismatches);
+    }
+    else if (b->mode == MODE_SUSPEND) {
+        printf(" block %zu burst %d\n", b->block, b->depth);
+        printf("cycles: %llu suspends woken by I/O, %.2f MB/s overall\n", b->ops, r->mb_per_s);
+    }
+    else {
+        printf("%s\n", b->nosync ? " nosync" : "");
+        printf("rate: %.0f ops/s (%llu ops in %.2f s)\n", r->ops_per_s, b->ops, r->elapsed);
+    }
+    printf("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f (%lu samples)\n",
+           r->lat[0], r->lat[1], r->lat[2], r->lat[3], r->lat[4], r->lat[5], b->nr_samples);
+    printf("cpu: user %.1f%% sys %.1f%% of one core\n", r->user, r->sys);
+    if (b->verify && b->mode != MODE_CONTEND)
+        printf("verify: %llu %s mismatched\n", b->mismatches, b->mode == MODE_SUSPEND ? "blocks" : "bytes");
+}
+
+/*One JSON object per line, so a saved report works as a baseline*/
+static void report_json(struct suite *st, struct bench *b, struct result *r) {
+    int i;
+
+    printf("%s  {\"name\": \"%s\", \"mode\": \"%s\", \"block\": %zu, \"depth\": %d, \"seconds\": %d",
+           st->runs++ ? ",\n" : "[\n", b->name, mode_names[b->mode], b->block, b->depth, b->seconds);
+    printf(", \"mb_per_s\": %.3f, \"ops_per_s\": %.1f, \"samples\": %lu", r->mb_per_s, r->ops_per_s, b->nr_samples);
+    for (i = 0; i < 6; i++)
+        printf(", \"lat_%s_us\": %.1f", lat_names[i], r->lat[i]);
+    printf(", \"cpu_user_pct\": %.1f, \"cpu_sys_pct\": %.1f, \"mismatches\": %llu",
+           r->user, r->sys, b->mismatches);
+    if (b->mode == MODE_CONTEND)
+        printf(", \"granted\": %llu, \"busy\": %llu", b->granted, b->busy);
+    printf(", \"error\": %d, \"regressions\": %d}", r->error, r->regressions);
+    fflush(stdout);
+}
+
+/*Value of key in the baseline object of this scenario, -1 if absent*/
+static double baseline_value(struct suite *st, const char *name, const char *key) {
+    char pat[128];
+    const char *obj, *end, *p;
+
+    snprintf(pat, sizeof(pat), "\"name\": \"%s\"", name);
+    obj = strstr(st->baseline_text, pat);
+    if (!obj)
+        return -1;
+    end = strchr(obj, '}');
+
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    p = strstr(obj, pat);
+    if (!p || (end && p > end))
+        return -1;
+    return strtod(p + strlen(pat), NULL);
+}
+
+/*Flag rates below and p99 latency above the baseline by more than the
+  tolerance, and any data mismatch or exclusivity violation*/
+static void check_baseline(struct suite *st, struct bench *b, struct result *r) {
+    double slack = st->tolerance / 100.0;
+    double base;
+
+    if (b->mismatches) {
+        fprintf(stderr, "regression: %s %llu mismatches\n", b->name, b->mismatches);
+        r->regressions++;
+    }
+    if (!st->baseline_text)
+        return;
+
+    base = baseline_value(st, b->name, is_loopback(b->mode) ? "mb_per_s" : "ops_per_s");
+    if (b->mode != MODE_SUSPEND && base > 0 &&
+        (is_loopback(b->mode) ? r->mb_per_s : r->ops_per_s) < base * (1 - slack)) {
+        fprintf(stderr, "regression: %s rate %.2f below baseline %.2f\n", b->name,
+                is_loopback(b->mode) ? r->mb_per_s : r->ops_per_s, base);
+        r->regressions++;
+    }
+
+    base = baseline_value(st, b->name, "lat_p99_us");
+    if (base > 0 && r->lat[3] > base * (1 + slack)) {
+        fprintf(stderr, "regression: %s p99 latency %.1f us above baseline %.1f us\n",
+                b->name, r->lat[3], base);
+        r->regressions++;
+    }
+}
+
+static char *load_file(const char *path) {
+    char *text = NULL;
+    long len;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    if (fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        text = malloc(len + 1);
+        if (text) {
+            len = fread(text, 1, len, f);
+            text[len] = '\0';
+        }
+    }
+    fclose(f);
+
+    return text;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-m rw|aio|mmap|ioctl|sysfs|events|contend|suspend] [-d device]\n"
+            "          [-s sysfs dir] [-b block size] [-q queue depth] [-t seconds]\n"
+            "          [-1] [-v] [-x] [-n name] [-f scenario file] [-j]\n"
+            "          [-B baseline.json] [-T tolerance %%]\n"
+            "  -1  rw and aio modes read and write on one O_RDWR file\n"
+            "  -v  verify loopback data\n"
+            "  -x  ioctl and sysfs modes don't wait for the device (no sync)\n"
+            "  -q  contend: opening threads, suspend: round trips per wakeup\n"
+            "  -f  run every line of the file, a name followed by options\n"
+            "  -j  print results as JSON\n"
+            "  -B  flag results worse than this earlier -j output\n"
+            "  -T  how much worse counts, default %d%%\n",
+            prog, DEF_TOLERANCE);
+}
+
+/*Parse run options into b. Suite options are only taken with st set*/
+static int parse_args(struct bench *b, struct suite *st, int argc, char **argv) {
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "m:d:s:b:q:t:1vxn:f:jB:T:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            for (b->mode = 0; b->mode < MODE_COUNT; b->mode++)
+                if (!strcmp(optarg, mode_names[b->mode]))
+                    break;
+            if (b->mode == MODE_COUNT)
+                return -1;
+            break;
+        case 'd': b->device  = optarg; break;
+        case 's': b->sysfs   = optarg; break;
+        case 'b': b->block   = strtoul(optarg, NULL, 0); break;
+        case 'q': b->depth   = atoi(optarg); break;
+        case 't': b->seconds = atoi(optarg); break;
+        case 'v': b->verify  = 1; break;
+        case 'x': b->nosync  = 1; break;
+        case '1': b->duplex  = 1; break;
+        case 'n': b->name    = optarg; break;
+        case 'f':
+        case 'j':
+        case 'B':
+        case 'T':
+            if (!st)
+                return -1;
+            if (opt == 'f') st->scenarios = optarg;
+            if (opt == 'j') st->json      = 1;
+            if (opt == 'B') st->baseline  = optarg;
+            if (opt == 'T') st->tolerance = atof(optarg);
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (optind < argc)
+        return -1;
+
+    if (!b->block || b->depth < 1 || b->depth > MAX_DEPTH || b->seconds < 1) {
+        fprintf(stderr, "block size must be non-zero, queue depth 1 to %d and time at least 1 s\n",
+                MAX_DEPTH);
+        return -1;
+    }
+    if (!b->name)
+        b->name = mode_names[b->mode];
+
+    return 0;
+}
+
+/*Run b and report it. Returns -1 if the run failed, 1 on a regression*/
+static int run_one(struct suite *st, struct bench *b) {
+    struct rusage ru0, ru1;
+    struct result r;
+    uint64_t start;
+    double elapsed;
+    int retval;
+
+    memset(&r, 0, sizeof(r));
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+    b->fd = -1;
+    b->samples = malloc(MAX_SAMPLES * sizeof(*b->samples));
+    if (!b->samples) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+
+    getrusage(RUSAGE_SELF, &ru0);
+    start = now_ns();
+
+    if (b->mode <= MODE_MMAP)
+        retval = run_loopback(b);
+    else if (b->mode == MODE_EVENTS)
+        retval = run_events(b);
+    else if (b->mode == MODE_CONTEND)
+        retval = run_contend(b);
+    else if (b->mode == MODE_SUSPEND)
+        retval = run_suspend(b);
+    else
+        retval = run_control(b);
+
+    /*Loopback throughput counts up to the last data read back, not the drain*/
+    if (b->mode <= MODE_MMAP && b->last_in_ns)
+        elapsed = (b->last_in_ns - start) / 1e9;
+    else
+        elapsed = (now_ns() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &ru1);
+
+    if (retval < 0) {
+        r.error = errno;
+        fprintf(stderr, "%s: %s\n", b->name, strerror(errno));
+    }
+
+    summarize(b, &r, elapsed, &ru0, &ru1);
+    check_baseline(st, b, &r);
+    if (st->json)
+        report_json(st, b, &r);
+    else if (b->nr_samples)
+        report(b, &r);
+
+    if (b->fd != -1)
+        close(b->fd);
+    free(b->samples);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+
+    return retval < 0 ? -1 : r.regressions ? 1 : 0;
+}
+
+/*Run each scenario line with the command line options as defaults*/
+static int run_scenarios(struct suite *st, struct bench *defaults, const char *prog) {
+    char line[LINE_LEN];
+    char *argv[MAX_ARGS + 1];
+    struct bench b;
+    int argc, lineno = 0, failed = 0, regressed = 0;
+    char *p;
+    FILE *f;
+
+    f = fopen(st->scenarios, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", st->scenarios, strerror(errno));
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        if ((p = strchr(line, '#')))
+            *p = '\0';
+
+        /*First word names the scenario, the rest are options*/
+        argv[0] = (char *)prog;
+        argc = 1;
+        for (p = strtok(line, " \t\r\n"); p && argc < MAX_ARGS; p = strtok(NULL, " \t\r\n"))
+            argv[argc++] = p;
+        argv[argc] = NULL;
+        if (argc == 1)
+            continue;
+
+        b = *defaults;
+        b.name = argv[1];
+        argv[1] = (char *)prog;
+        if (parse_args(&b, NULL, argc - 1, argv + 1) < 0) {
+            fprintf(stderr, "%s:%d: bad scenario\n", st->scenarios, lineno);
+            failed++;
+            continue;
+        }
+
+        switch (run_one(st, &b)) {
+        case -1: failed++;    break;
+        case 1:  regressed++; break;
+        }
+    }
+    fclose(f);
+
+    return failed ? -1 : regressed ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    struct suite st;
+    struct bench b;
+    int retval;
+
+    memset(&st, 0, sizeof(st));
+    st.tolerance = DEF_TOLERANCE;
+
+    memset(&b, 0, sizeof(b));
+    b.mode    = MODE_RW;
+    b.device  = DEF_DEVICE;
+    b.sysfs   = DEF_SYSFS;
+    b.block   = DEF_BLOCK;
+    b.depth   = DEF_DEPTH;
+    b.seconds = DEF_SECONDS;
+
+    if (parse_args(&b, &st, argc, argv) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (st.baseline) {
+        st.baseline_text = load_file(st.baseline);
+        if (!st.baseline_text) {
+            fprintf(stderr, "%s: %s\n", st.baseline, strerror(errno));
+            return 1;
+        }
+    }
+
+    if (st.scenarios) {
+        /*Scenario names come from the file*/
+        b.name = NULL;
+        retval = run_scenarios(&st, &b, argv[0]);
+    }
+    else
+        retval = run_one(&st, &b);
+
+    if (st.json)
+        printf("%s]\n", st.runs ? "\n" : "[\n");
+    free(st.baseline_text);
+
+    /*1 when a run failed, 2 when one regressed*/
+    return retval < 0 ? 1 : retval ? 2 : 0;
+}
@@ -0,0 +1,585 @@
+/*****************************************************
+ * User space library for many OSR FX2 boards        *
+ * Boards are found through the usb class devices,   *
+ * grouped by host controller and driven by one      *
+ * worker thread per controller, pinned to the CPUs  *
+ * local to that controller                          *
+ *****************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+
+#include "osrfx2_ioctl.h"
+#include "osrfx2_fleet.h"
+
+#define MAX_BOARDS 256
+
+/*usb core names the class directory usbmisc, older kernels used usb*/
+static const char *class_dirs[] = { "/sys/class/usbmisc", "/sys/class/usb" };
+
+/*Host controller and the worker thread serving its boards*/
+struct osrfx2_hc {
+    char                  path[OSRFX2_PATH_LEN]; /*Controller device directory*/
+    cpu_set_t             cpus;     /*local_cpulist of the controller*/
+    int                   has_cpus;
+    struct osrfx2_board **boards;
+    int                   count;
+    pthread_t             thread;
+    int                   started;
+    struct osrfx2_fleet * fleet;
+};
+
+struct osrfx2_fleet {
+    struct osrfx2_board * boards;
+    int                   count;
+    struct osrfx2_hc    * hcs;
+    int                   hc_count;
+
+    /*Current operation, handed to the workers by bumping gen*/
+    pthread_mutex_t       lock;
+    pthread_cond_t        work;
+    pthread_cond_t        done;
+    unsigned long         gen;
+    int                   busy;     /*Workers still running the operation*/
+    int                   failed;
+    int                   stop;
+    osrfx2_board_fn       fn;
+    void                * arg;
+};
+
+/*************************Single board helpers*************************/
+/*Format a bit value like the sysfs attributes, bit 7 first*/
+char *osrfx2_bits_to_str(unsigned char value, char *str) {
+    int i;
+
+    for (i = 0; i < 8; i++)
+        str[i] = (value & (0x80 >> i)) ? '1' : '0';
+    str[8] = '\0';
+
+    return str;
+}
+
+int osrfx2_get_switches(int fd, unsigned char *value) {
+    return ioctl(fd, OSRFX2_IOC_GET_SWITCHES, value);
+}
+
+int osrfx2_get_7segment(int fd, unsigned char *value) {
+    return ioctl(fd, OSRFX2_IOC_GET_7SEG, value);
+}
+
+int osrfx2_get_bargraph(int fd, unsigned char *value) {
+    return ioctl(fd, OSRFX2_IOC_GET_BARGRAPH, value);
+}
+
+/*Set the 7 segment display and bargraph in one call*/
+int osrfx2_set_display(int fd, unsigned char segments, unsigned char bargraph, int sync) {
+    struct osrfx2_display disp;
+
+    memset(&disp, 0, sizeof(disp));
+    disp.segments = segments;
+    disp.bargraph = bargraph;
+    disp.flags    = OSRFX2_DISPLAY_7SEG | OSRFX2_DISPLAY_BARGRAPH;
+    if (sync)
+        disp.flags |= OSRFX2_DISPLAY_SYNC;
+
+    return ioctl(fd, OSRFX2_IOC_SET_DISPLAY, &disp);
+}
+
+/*************************sysfs attribute access***********************/
+static int open_attr(const char *sysfs, const char *name, int flags) {
+    char path[OSRFX2_PATH_LEN + 16];
+
+    snprintf(path, sizeof(path), "%s/%s", sysfs, name);
+    return open(path, flags);
+}
+
+int osrfx2_attrs_open(struct osrfx2_attrs *attrs, const char *sysfs) {
+    attrs->switches = open_attr(sysfs, "switches", O_RDONLY);
+    attrs->bargraph = open_attr(sysfs, "bargraph", O_RDWR);
+    attrs->segments = open_attr(sysfs, "7segment", O_RDWR);
+    attrs->sync     = open_attr(sysfs, "sync", O_WRONLY);
+
+    if (attrs->switches == -1 || attrs->bargraph == -1 ||
+        attrs->segments == -1 || attrs->sync == -1) {
+        osrfx2_attrs_close(attrs);
+        return -1;
+    }
+
+    return 0;
+}
+
+void osrfx2_attrs_close(struct osrfx2_attrs *attrs) {
+    int *fds[] = { &attrs->switches, &attrs->bargraph, &attrs->segments, &attrs->sync };
+    size_t i;
+
+    for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (*fds[i] != -1)
+            close(*fds[i]);
+        *fds[i] = -1;
+    }
+}
+
+/*Attributes read back as 8 binary digits, bit 7 first*/
+int osrfx2_attr_get(int fd, unsigned char *value) {
+    char buf[16];
+    unsigned char v = 0;
+    ssize_t len;
+    int i;
+
+    len = pread(fd, buf, sizeof(buf), 0);
+    if (len < 0)
+        return -1;
+
+    for (i = 0; i < 8; i++) {
+        if (i >= len || (buf[i] != '0' && buf[i] != '1')) {
+            errno = EAGAIN;         /*Suspended boards read back "S "*/
+            return -1;
+        }
+        v = (v << 1) | (buf[i] - '0');
+    }
+
+    *value = v;
+    return 0;
+}
+
+/*Attributes are written as a decimal value*/
+int osrfx2_attr_set(int fd, unsigned char value) {
+    char buf[4];
+    int len = 0;
+
+    if (value >= 100)
+        buf[len++] = '0' + value / 100;
+    if (value >= 10)
+        buf[len++] = '0' + value / 10 % 10;
+    buf[len++] = '0' + value % 10;
+
+    return pwrite(fd, buf, len, 0) == len ? 0 : -1;
+}
+
+/*Wait until queued bargraph and 7 segment writes reached the board*/
+int osrfx2_attrs_sync(struct osrfx2_attrs *attrs) {
+    return pwrite(attrs->sync, "1", 1, 0) == 1 ? 0 : -1;
+}
+
+/*****************************Discovery********************************/
+/*Parse a cpulist such as 0-3,8-11*/
+static int parse_cpulist(const char *list, cpu_set_t *cpus) {
+    const char *p = list;
+    char *end;
+    long first, last;
+    int found = 0;
+
+    CPU_ZERO(cpus);
+    while (*p && !isspace((unsigned char)*p)) {
+        first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+            found = 1;
+        }
+        p = (*end == ',') ? end + 1 : end;
+    }
+
+    return found;
+}
+
+/*The controller is the directory above the usbN root hub in the
+  interface path, e.g. .../0000:00:14.0 in .../0000:00:14.0/usb1/1-2/1-2:1.0*/
+static void hc_path(const char *sysfs, char *path) {
+    const char *p = sysfs;
+    const char *root = NULL;
+
+    while ((p = strstr(p, "/usb")) != NULL) {
+        if (isdigit((unsigned char)p[4])) {
+            root = p;
+            break;
+        }
+        p++;
+    }
+
+    if (!root) {
+        snprintf(path, OSRFX2_PATH_LEN, "%s", sysfs);
+        return;
+    }
+    snprintf(path, OSRFX2_PATH_LEN, "%.*s", (int)(root - sysfs), sysfs);
+}
+
+static struct osrfx2_hc *hc_find(struct osrfx2_fleet *fleet, const char *path) {
+    struct osrfx2_hc *hc;
+    char file[OSRFX2_PATH_LEN + 16];
+    char list[256];
+    FILE *f;
+    int i;
+
+    for (i = 0; i < fleet->hc_count; i++)
+        if (!strcmp(fleet->hcs[i].path, path))
+            return &fleet->hcs[i];
+
+    hc = &fleet->hcs[fleet->hc_count++];
+    snprintf(hc->path, sizeof(hc->path), "%s", path);
+    hc->fleet = fleet;
+
+    /*Not every controller has NUMA locality, run those unpinned*/
+    snprintf(file, sizeof(file), "%s/local_cpulist", path);
+    f = fopen(file, "r");
+    if (f) {
+        if (fgets(list, sizeof(list), f))
+            hc->has_cpus = parse_cpulist(list, &hc->cpus);
+        fclose(f);
+    }
+
+    return hc;
+}
+
+static int board_number(const struct osrfx2_board *board) {
+    return atoi(board->name + strlen("osrfx2_"));
+}
+
+static int board_cmp(const void *a, const void *b) {
+    return board_number(a) - board_number(b);
+}
+
+static int board_known(struct osrfx2_fleet *fleet, const char *name) {
+    int i;
+
+    for (i = 0; i < fleet->count; i++)
+        if (!strcmp(fleet->boards[i].name, name))
+            return 1;
+    return 0;
+}
+
+/*Fill fleet->boards from the usb class directories*/
+static void find_boards(struct osrfx2_fleet *fleet) {
+    struct osrfx2_board *board;
+    struct dirent *ent;
+    char link[OSRFX2_PATH_LEN + OSRFX2_NAME_LEN];
+    char real[PATH_MAX];
+    DIR *dir;
+    size_t i;
+
+    for (i = 0; i < sizeof(class_dirs) / sizeof(class_dirs[0]); i++) {
+        dir = opendir(class_dirs[i]);
+        if (!dir)
+            continue;
+
+        while ((ent = readdir(dir)) != NULL && fleet->count < MAX_BOARDS) {
+            if (strncmp(ent->d_name, "osrfx2_", strlen("osrfx2_")) ||
+                strlen(ent->d_name) >= OSRFX2_NAME_LEN ||
+                board_known(fleet, ent->d_name))
+                continue;
+
+            snprintf(link, sizeof(link), "%s/%s/device", class_dirs[i], ent->d_name);
+            if (!realpath(link, real) || strlen(real) >= OSRFX2_PATH_LEN)
+                continue;
+
+            board = &fleet->boards[fleet->count++];
+            strcpy(board->name, ent->d_name);
+            strcpy(board->sysfs, real);
+            snprintf(board->devpath, sizeof(board->devpath), "/dev/%s", board->name);
+            board->fd = -1;
+            board->attrs.switches = board->attrs.bargraph = -1;
+            board->attrs.segments = board->attrs.sync     = -1;
+        }
+        closedir(dir);
+    }
+
+    qsort(fleet->boards, fleet->count, sizeof(*fleet->boards), board_cmp);
+}
+
+/******************************Workers*********************************/
+static void *hc_worker(void *data) {
+    struct osrfx2_hc *hc = data;
+    struct osrfx2_fleet *fleet = hc->fleet;
+    struct osrfx2_board *board;
+    unsigned long seen = 0;
+    osrfx2_board_fn fn;
+    void *arg;
+    int failed;
+    int i;
+
+    pthread_mutex_lock(&fleet->lock);
+    for (;;) {
+        while (fleet->gen == seen && !fleet->stop)
+            pthread_cond_wait(&fleet->work, &fleet->lock);
+        if (fleet->stop)
+            break;
+
+        seen = fleet->gen;
+        fn   = fleet->fn;
+        arg  = fleet->arg;
+        pthread_mutex_unlock(&fleet->lock);
+
+        failed = 0;
+        for (i = 0; i < hc->count; i++) {
+            board = hc->boards[i];
+            if (board->fd < 0)
+                continue;
+            board->status = fn(board, arg);
+            if (board->status)
+                failed++;
+        }
+
+        pthread_mutex_lock(&fleet->lock);
+        fleet->failed += failed;
+        if (--fleet->busy == 0)
+            pthread_cond_signal(&fleet->done);
+    }
+    pthread_mutex_unlock(&fleet->lock);
+
+    return NULL;
+}
+
+static int hc_start(struct osrfx2_hc *hc) {
+    pthread_attr_t attr;
+    int retval;
+
+    pthread_attr_init(&attr);
+    if (hc->has_cpus)
+        pthread_attr_setaffinity_np(&attr, sizeof(hc->cpus), &hc->cpus);
+
+    retval = pthread_create(&hc->thread, &attr, hc_worker, hc);
+    pthread_attr_destroy(&attr);
+    if (retval)
+        return -retval;
+
+    hc->started = 1;
+    return 0;
+}
+
+/*****************************Fleet API********************************/
+struct osrfx2_fleet *osrfx2_fleet_open(int flags) {
+    struct osrfx2_fleet *fleet;
+    struct osrfx2_board *board;
+    struct osrfx2_hc *hc;
+    char path[OSRFX2_PATH_LEN];
+    int retval;
+    int i;
+
+    fleet = calloc(1, sizeof(*fleet));
+    if (!fleet)
+        return NULL;
+    fleet->boards = calloc(MAX_BOARDS, sizeof(*fleet->boards));
+    fleet->hcs    = calloc(MAX_BOARDS, sizeof(*fleet->hcs));
+    if (!fleet->boards || !fleet->hcs) {
+        free(fleet->boards);
+        free(fleet->hcs);
+        free(fleet);
+        errno = ENOMEM;
+        return NULL;
+    }
+    pthread_mutex_init(&fleet->lock, NULL);
+    pthread_cond_init(&fleet->work, NULL);
+    pthread_cond_init(&fleet->done, NULL);
+
+    find_boards(fleet);
+    if (!fleet->count) {
+        osrfx2_fleet_close(fleet);
+        errno = ENODEV;
+        return NULL;
+    }
+
+    /*Group the boards by host controller*/
+    for (i = 0; i < fleet->count; i++) {
+        board = &fleet->boards[i];
+        hc_path(board->sysfs, path);
+        board->hc = hc_find(fleet, path);
+    }
+    for (i = 0; i < fleet->hc_count; i++) {
+        fleet->hcs[i].boards = calloc(fleet->count, sizeof(*fleet->hcs[i].boards));
+        if (!fleet->hcs[i].boards) {
+            osrfx2_fleet_close(fleet);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+    for (i = 0; i < fleet->count; i++) {
+        hc = fleet->boards[i].hc;
+        hc->boards[hc->count++] = &fleet->boards[i];
+    }
+
+    /*Files stay open for the life of the fleet. A board that is busy or
+      gone keeps fd -1 and is skipped*/
+    for (i = 0; i < fleet->count; i++) {
+        board = &fleet->boards[i];
+        board->fd = open(board->devpath, flags);
+        if (board->fd < 0)
+            board->status = -errno;
+        osrfx2_attrs_open(&board->attrs, board->sysfs);
+    }
+
+    for (i = 0; i < fleet->hc_count; i++) {
+        retval = hc_start(&fleet->hcs[i]);
+        if (retval) {
+            osrfx2_fleet_close(fleet);
+            errno = -retval;
+            return NULL;
+        }
+    }
+
+    return fleet;
+}
+
+void osrfx2_fleet_close(struct osrfx2_fleet *fleet) {
+    int i;
+
+    if (!fleet)
+        return;
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet->stop = 1;
+    pthread_cond_broadcast(&fleet->work);
+    pthread_mutex_unlock(&fleet->lock);
+
+    for (i = 0; i < fleet->hc_count; i++) {
+        if (fleet->hcs[i].started)
+            pthread_join(fleet->hcs[i].thread, NULL);
+        free(fleet->hcs[i].boards);
+    }
+
+    for (i = 0; i < fleet->count; i++) {
+        if (fleet->boards[i].fd >= 0)
+            close(fleet->boards[i].fd);
+        osrfx2_attrs_close(&fleet->boards[i].attrs);
+    }
+
+    pthread_cond_destroy(&fleet->done);
+    pthread_cond_destroy(&fleet->work);
+    pthread_mutex_destroy(&fleet->lock);
+    free(fleet->hcs);
+    free(fleet->boards);
+    free(fleet);
+}
+
+int osrfx2_fleet_count(struct osrfx2_fleet *fleet) {
+    return fleet->count;
+}
+
+struct osrfx2_board *osrfx2_fleet_board(struct osrfx2_fleet *fleet, int index) {
+    if (index < 0 || index >= fleet->count)
+        return NULL;
+    return &fleet->boards[index];
+}
+
+int osrfx2_fleet_hc_count(struct osrfx2_fleet *fleet) {
+    return fleet->hc_count;
+}
+
+/*Not reentrant, one operation runs at a time*/
+int osrfx2_fleet_each(struct osrfx2_fleet *fleet, osrfx2_board_fn fn, void *arg) {
+    int failed;
+
+    pthread_mutex_lock(&fleet->lock);
+    fleet->fn     = fn;
+    fleet->arg    = arg;
+    fleet->failed = 0;
+    fleet->busy   = fleet->hc_count;
+    fleet->gen++;
+    pthread_cond_broadcast(&fleet->work);
+
+    while (fleet->busy)
+        pthread_cond_wait(&fleet->done, &fleet->lock);
+    failed = fleet->failed;
+    pthread_mutex_unlock(&fleet->lock);
+
+    return failed;
+}
+
+/*************************Batched operations***************************/
+struct display_op {
+    unsigned char segments;
+    unsigned char bargraph;
+};
+
+struct io_op {
+    struct osrfx2_fleet *fleet;
+    const void *wbuf;
+    void       *rbufs;
+    size_t      len;
+};
+
+static int do_set_display(struct osrfx2_board *board, void *arg) {
+    struct display_op *op = arg;
+
+    return osrfx2_set_display(board->fd, op->segments, op->bargraph, 0) ? -errno : 0;
+}
+
+/*Waits for the writes queued by do_set_display*/
+static int do_sync(struct osrfx2_board *board, void *arg) {
+    struct osrfx2_display disp;
+
+    (void)arg;  /*Nothing to pass, a sync takes no values*/
+    memset(&disp, 0, sizeof(disp));
+    disp.flags = OSRFX2_DISPLAY_SYNC;
+
+    return ioctl(board->fd, OSRFX2_IOC_SET_DISPLAY, &disp) ? -errno : 0;
+}
+
+static int do_get_switches(struct osrfx2_board *board, void *arg) {
+    (void)arg;  /*The result goes to board->value*/
+    return osrfx2_get_switches(board->fd, &board->value) ? -errno : 0;
+}
+
+static int do_write(struct osrfx2_board *board, void *arg) {
+    struct io_op *op = arg;
+
+    board->length = write(board->fd, op->wbuf, op->len);
+    return board->length < 0 ? -errno : 0;
+}
+
+static int do_read(struct osrfx2_board *board, void *arg) {
+    struct io_op *op = arg;
+    char *buf = (char *)op->rbufs + (board - op->fleet->boards) * op->len;
+
+    board->length = read(board->fd, buf, op->len);
+    return board->length < 0 ? -errno : 0;
+}
+
+int osrfx2_fleet_set_display(struct osrfx2_fleet *fleet, unsigned char segments,
+                             unsigned char bargraph, int sync) {
+    struct display_op op = { segments, bargraph };
+    int failed;
+
+    /*The driver queues register writes, so the first pass returns as
+      soon as every board has them and the second overlaps the waits*/
+    failed = osrfx2_fleet_each(fleet, do_set_display, &op);
+    if (sync)
+        failed += osrfx2_fleet_each(fleet, do_sync, NULL);
+
+    return failed;
+}
+
+/*Switch state of each board lands in board->value*/
+int osrfx2_fleet_get_switches(struct osrfx2_fleet *fleet) {
+    return osrfx2_fleet_each(fleet, do_get_switches, NULL);
+}
+
+/*Send the same data to every board, bytes sent in board->length*/
+int osrfx2_fleet_write(struct osrfx2_fleet *fleet, const void *buf, size_t len) {
+    struct io_op op = { fleet, buf, NULL, len };
+
+    return osrfx2_fleet_each(fleet, do_write, &op);
+}
+
+/*Read up to len bytes from every board. bufs holds len bytes per
+  board in board order, bytes read in board->length*/
+int osrfx2_fleet_read(struct osrfx2_fleet *fleet, void *bufs, size_t len) {
+    struct io_op op = { fleet, NULL, bufs, len };
+
+    return osrfx2_fleet_each(fleet, do_read, &op);
+}
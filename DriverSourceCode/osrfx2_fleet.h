@@ -0,0 +1,90 @@
+/************************************************
+ * User space library for many OSR FX2 boards   *
+ * Finds every bound board, keeps its device    *
+ * file open and runs operations on all boards  *
+ * at once from one thread per host controller  *
+ ************************************************/
+
+#ifndef OSRFX2_FLEET_H
+#define OSRFX2_FLEET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define OSRFX2_NAME_LEN 32
+#define OSRFX2_PATH_LEN 256
+
+struct osrfx2_hc;
+
+/*sysfs attribute files of one board, opened once and read with pread
+  at offset 0. A file that failed to open is -1*/
+struct osrfx2_attrs {
+    int switches;
+    int bargraph;
+    int segments;                   /*7segment*/
+    int sync;
+};
+
+/*One bound board*/
+struct osrfx2_board {
+    char   name[OSRFX2_NAME_LEN];   /*Class device name, osrfx2_N*/
+    char   devpath[OSRFX2_PATH_LEN];/*Device node, /dev/osrfx2_N*/
+    char   sysfs[OSRFX2_PATH_LEN];  /*Interface directory holding the attributes*/
+    int    fd;                      /*Open device file, -1 if the open failed*/
+    struct osrfx2_attrs attrs;      /*Open attribute files*/
+    struct osrfx2_hc *hc;           /*Host controller the board hangs off*/
+
+    /*Per board results of the last fleet operation*/
+    int           status;           /*0 or -errno*/
+    unsigned char value;            /*Byte read by the get operations*/
+    ssize_t       length;           /*Bytes moved by read and write*/
+};
+
+struct osrfx2_fleet;
+
+/*Runs on one board from its host controller's worker thread. Returns 0
+  or -errno, stored in board->status*/
+typedef int (*osrfx2_board_fn)(struct osrfx2_board *board, void *arg);
+
+/*Single board helpers on an open device file, see osrfx2_ioctl.h*/
+char *osrfx2_bits_to_str(unsigned char value, char *str);
+int osrfx2_get_switches(int fd, unsigned char *value);
+int osrfx2_get_7segment(int fd, unsigned char *value);
+int osrfx2_get_bargraph(int fd, unsigned char *value);
+int osrfx2_set_display(int fd, unsigned char segments, unsigned char bargraph, int sync);
+
+/*sysfs attribute access without a path lookup or allocation per call.
+  sysfs is the interface directory, e.g. /sys/class/usb/osrfx2_0/device.
+  get and set return 0, or -1 with errno set. get fails with EAGAIN
+  while the board is suspended*/
+int osrfx2_attrs_open(struct osrfx2_attrs *attrs, const char *sysfs);
+void osrfx2_attrs_close(struct osrfx2_attrs *attrs);
+int osrfx2_attr_get(int fd, unsigned char *value);
+int osrfx2_attr_set(int fd, unsigned char value);
+int osrfx2_attrs_sync(struct osrfx2_attrs *attrs);
+
+/*Find and open every board. flags are open() flags for the device
+  files, O_RDWR claims both bulk pipes. Returns NULL with errno set*/
+struct osrfx2_fleet *osrfx2_fleet_open(int flags);
+void osrfx2_fleet_close(struct osrfx2_fleet *fleet);
+
+int osrfx2_fleet_count(struct osrfx2_fleet *fleet);
+struct osrfx2_board *osrfx2_fleet_board(struct osrfx2_fleet *fleet, int index);
+int osrfx2_fleet_hc_count(struct osrfx2_fleet *fleet);
+
+/*Run fn on every board with an open file and wait for all of them.
+  Boards on different host controllers run in parallel. Returns the
+  number of boards that failed*/
+int osrfx2_fleet_each(struct osrfx2_fleet *fleet, osrfx2_board_fn fn, void *arg);
+
+/*Batched operations built on osrfx2_fleet_each. Register writes are
+  queued on every board first, with sync a second pass waits for
+  them to reach the devices*/
+int osrfx2_fleet_set_display(struct osrfx2_fleet *fleet, unsigned char segments,
+                             unsigned char bargraph, int sync);
+int osrfx2_fleet_get_switches(struct osrfx2_fleet *fleet);
+int osrfx2_fleet_write(struct osrfx2_fleet *fleet, const void *buf, size_t len);
+/*bufs holds len bytes for each board, in board order*/
+int osrfx2_fleet_read(struct osrfx2_fleet *fleet, void *bufs, size_t len);
+
+#endif
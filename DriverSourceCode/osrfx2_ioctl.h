@@ -0,0 +1,104 @@
+/************************************************
+ * ioctl interface for the OSR FX2 board        *
+ * Shared by my_usb_driver.c and user space     *
+ ************************************************/
+
+#ifndef OSRFX2_IOCTL_H
+#define OSRFX2_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define OSRFX2_IOC_MAGIC 'F'
+
+/*Layout of the mmap ring. The mapping holds nr_in bulk in buffers
+  followed by nr_out bulk out buffers, each buf_size bytes long.
+  Bulk in buffer i starts at offset i * buf_size and bulk out
+  buffer j at offset (nr_in + j) * buf_size*/
+struct osrfx2_mmap_info {
+    __u32 buf_size;
+    __u32 nr_in;
+    __u32 nr_out;
+    __u32 reserved;
+};
+
+/*Hands one mmap buffer to or from the driver*/
+struct osrfx2_mmap_buf {
+    __u32 index;        /*Buffer index within its direction*/
+    __u32 length;       /*Bytes to send, or bytes received on reap*/
+    __s32 status;       /*URB status on reap, 0 on success*/
+    __u32 reserved;
+};
+
+/*Switch change record returned by read() in event mode*/
+struct osrfx2_switch_event {
+    __u64 timestamp_ns; /*CLOCK_MONOTONIC time the change arrived*/
+    __u8  switches;     /*New switch state, bit 7 = leftmost switch*/
+    __u8  reserved[7];
+};
+
+#define OSRFX2_IOC_MMAP_INFO  _IOR(OSRFX2_IOC_MAGIC, 0x01, struct osrfx2_mmap_info)
+#define OSRFX2_IOC_SUBMIT_OUT _IOW(OSRFX2_IOC_MAGIC, 0x02, struct osrfx2_mmap_buf)
+#define OSRFX2_IOC_REAP_OUT   _IOR(OSRFX2_IOC_MAGIC, 0x03, struct osrfx2_mmap_buf)
+#define OSRFX2_IOC_SUBMIT_IN  _IOW(OSRFX2_IOC_MAGIC, 0x04, struct osrfx2_mmap_buf)
+#define OSRFX2_IOC_REAP_IN    _IOR(OSRFX2_IOC_MAGIC, 0x05, struct osrfx2_mmap_buf)
+
+/*Switch this file to event mode. read() then returns whole
+  struct osrfx2_switch_event records and poll() reports POLLIN
+  when one is queued. The file gives up the bulk in pipe*/
+#define OSRFX2_IOC_EVENT_MODE _IO(OSRFX2_IOC_MAGIC, 0x06)
+
+/*Vendor commands as raw bytes. Bargraph and 7 segment values use the
+  same bit order as the sysfs attributes, bit 0 = bottom LED or seg a*/
+#define OSRFX2_IOC_GET_7SEG      _IOR(OSRFX2_IOC_MAGIC, 0x07, __u8)
+#define OSRFX2_IOC_SET_7SEG      _IOW(OSRFX2_IOC_MAGIC, 0x08, __u8)
+#define OSRFX2_IOC_GET_BARGRAPH  _IOR(OSRFX2_IOC_MAGIC, 0x09, __u8)
+#define OSRFX2_IOC_SET_BARGRAPH  _IOW(OSRFX2_IOC_MAGIC, 0x0A, __u8)
+#define OSRFX2_IOC_GET_SWITCHES  _IOR(OSRFX2_IOC_MAGIC, 0x0B, __u8)
+#define OSRFX2_IOC_IS_HIGH_SPEED _IOR(OSRFX2_IOC_MAGIC, 0x0C, __u8)
+
+/*Sets the bargraph and 7 segment display in one call*/
+struct osrfx2_display {
+    __u8 bargraph;
+    __u8 segments;
+    __u8 flags;         /*OSRFX2_DISPLAY_* */
+    __u8 reserved;
+};
+
+#define OSRFX2_DISPLAY_BARGRAPH 0x01    /*Set bargraph*/
+#define OSRFX2_DISPLAY_7SEG     0x02    /*Set segments*/
+#define OSRFX2_DISPLAY_SYNC     0x04    /*Return once the device took the new values*/
+
+#define OSRFX2_IOC_SET_DISPLAY   _IOW(OSRFX2_IOC_MAGIC, 0x0D, struct osrfx2_display)
+
+/*Bytes the receive ring must hold before read() returns or poll()
+  reports POLLIN, 1 up to the ring size. A read asking for less waits
+  for its own length only. A read timeout returns whatever arrived.
+  Reset to 1 each time the device is opened for reading*/
+#define OSRFX2_IOC_SET_RX_LOWAT  _IOW(OSRFX2_IOC_MAGIC, 0x0E, __u32)
+
+/*Bulk read timeout of this file in ms. 0 falls back to the
+  read_timeout_ms module parameter. OSRFX2_READ_TIMEOUT_ADAPTIVE derives
+  it from how long recent reads waited for their data, so a lost packet
+  fails fast. GET returns the timeout the next read would use*/
+#define OSRFX2_READ_TIMEOUT_ADAPTIVE (-1)
+
+#define OSRFX2_IOC_SET_READ_TIMEOUT _IOW(OSRFX2_IOC_MAGIC, 0x0F, __s32)
+#define OSRFX2_IOC_GET_READ_TIMEOUT _IOR(OSRFX2_IOC_MAGIC, 0x10, __s32)
+
+/*Message mode, 1 on and 0 off. Every write() on the file then ends in a
+  short packet, or a zero length packet when its length is a multiple of
+  the packet size. On a reading file each read() returns at most one
+  message, what the device sent up to a short packet or ZLP. A message
+  larger than the read buffer comes out over several reads. Switching
+  discards received data not yet read. Off each time the device is
+  opened for reading*/
+#define OSRFX2_IOC_SET_MSG_MODE  _IOW(OSRFX2_IOC_MAGIC, 0x11, __u32)
+
+/*Read-ahead prefetch, 1 on (the default on open) and 0 off. On, bulk in
+  URBs are kept in flight even with nobody reading, for streams. Off,
+  they only go out while a read() or poll() waits for data, so the
+  device holds on to anything nobody asked for yet*/
+#define OSRFX2_IOC_SET_PREFETCH  _IOW(OSRFX2_IOC_MAGIC, 0x12, __u32)
+
+#endif
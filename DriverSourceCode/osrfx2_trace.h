@@ -0,0 +1,60 @@
+/************************************************
+ * Tracepoints for the OSR FX2 board driver     *
+ * Included by my_usb_driver.c                  *
+ ************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM osrfx2
+
+#if !defined(OSRFX2_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define OSRFX2_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/usb.h>
+
+/*One transfer request. tag is the URB, or the scatter-gather request,
+  and ties each submit to its completion. ep is the endpoint address
+  with USB_DIR_IN set for device to host*/
+DECLARE_EVENT_CLASS(osrfx2_xfer,
+    TP_PROTO(const void *tag, unsigned int pipe, u32 length, int status),
+
+    TP_ARGS(tag, pipe, length, status),
+
+    TP_STRUCT__entry(
+        __field(const void *, tag)
+        __field(u8,           ep)
+        __field(u32,          length)
+        __field(int,          status)
+    ),
+
+    TP_fast_assign(
+        __entry->tag    = tag;
+        __entry->ep     = usb_pipeendpoint(pipe) | (usb_pipein(pipe) ? USB_DIR_IN : 0);
+        __entry->length = length;
+        __entry->status = status;
+    ),
+
+    TP_printk("tag=%p ep=0x%02x length=%u status=%d",
+              __entry->tag, __entry->ep, __entry->length, __entry->status)
+);
+
+/*Request handed to usb core, length is the transfer buffer length*/
+DEFINE_EVENT(osrfx2_xfer, osrfx2_submit,
+    TP_PROTO(const void *tag, unsigned int pipe, u32 length, int status),
+    TP_ARGS(tag, pipe, length, status)
+);
+
+/*Request given back, length is the byte count actually transferred*/
+DEFINE_EVENT(osrfx2_xfer, osrfx2_complete,
+    TP_PROTO(const void *tag, unsigned int pipe, u32 length, int status),
+    TP_ARGS(tag, pipe, length, status)
+);
+
+#endif
+
+/*Must be outside the include guard*/
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE osrfx2_trace
+#include <trace/define_trace.h>